@@ -0,0 +1,308 @@
+#include "copy_on_write.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace
+{
+
+template <typename F>
+double time_ms(F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+unsigned thread_count()
+{
+  auto n = std::thread::hardware_concurrency();
+  return n < 2 ? 2 : n;
+}
+
+//
+// Half of the threads read the payload while the other half copy and release
+// handles to it, hammering the reference counts.
+//
+
+struct small_payload
+{
+  int values[4] = {1, 2, 3, 4};
+};
+
+double read_while_copying(const copy_on_write<small_payload>& c)
+{
+  const auto threads = thread_count();
+  const std::size_t iterations = 2000000;
+  std::atomic<bool> done{false};
+  std::atomic<long> sink{0};
+
+  std::vector<std::thread> copiers;
+  for (unsigned i = 0; i < threads / 2; ++i)
+  {
+    copiers.emplace_back([&] {
+      while (!done)
+      {
+        copy_on_write<small_payload> tmp(c);
+      }
+    });
+  }
+
+  auto ms = time_ms([&] {
+    std::vector<std::thread> readers;
+    for (unsigned i = 0; i < threads - threads / 2; ++i)
+    {
+      readers.emplace_back([&] {
+        long sum = 0;
+        for (std::size_t n = 0; n < iterations; ++n)
+        {
+          const small_payload& p = *c;
+          sum += p.values[n & 3];
+          std::atomic_signal_fence(std::memory_order_seq_cst);
+        }
+        sink += sum;
+      });
+    }
+    for (auto& t : readers)
+    {
+      t.join();
+    }
+  });
+
+  done = true;
+  for (auto& t : copiers)
+  {
+    t.join();
+  }
+  return ms;
+}
+
+void benchmark_false_sharing()
+{
+  // A detached clone lives in a single make_shared allocation, directly after
+  // the shared_ptr counts.
+  auto original = make_copy_on_write<small_payload>();
+  auto clone = original;
+  mutate(clone);
+
+  std::printf("read+copy (%u threads)\n", thread_count());
+  std::printf("  direct_shared_control_block:      %8.2f ms\n",
+              read_while_copying(clone));
+  std::printf("  make_cache_aligned_copy_on_write: %8.2f ms\n",
+              read_while_copying(
+                  make_cache_aligned_copy_on_write<small_payload>()));
+}
+
+//
+// Scans and updates a vector of one million handles whose payloads are
+// scattered through the heap.
+//
+
+struct scan_payload
+{
+  double values[8] = {};
+};
+
+std::vector<copy_on_write<scan_payload>> scattered_handles(std::size_t n)
+{
+  std::vector<copy_on_write<scan_payload>> v;
+  v.reserve(n);
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    v.push_back(make_copy_on_write<scan_payload>());
+  }
+  std::shuffle(v.begin(), v.end(), std::mt19937(42));
+  return v;
+}
+
+void benchmark_prefetch()
+{
+  auto v = scattered_handles(1000000);
+  double sum = 0.0;
+
+  std::printf("scan of %zu handles\n", v.size());
+  std::printf("  range-for operator*:              %8.2f ms\n", time_ms([&] {
+                for (const auto& c : v)
+                {
+                  sum += c->values[0];
+                }
+              }));
+  std::printf("  for_each_value:                   %8.2f ms\n", time_ms([&] {
+                for_each_value(
+                    v, [&](const scan_payload& p) { sum += p.values[0]; });
+              }));
+  std::printf("  range-for mutate:                 %8.2f ms\n", time_ms([&] {
+                for (auto& c : v)
+                {
+                  mutate(c)->values[0] += 1.0;
+                }
+              }));
+  std::printf("  transform_mutate:                 %8.2f ms\n", time_ms([&] {
+                transform_mutate(
+                    v, [](scan_payload& p) { p.values[0] += 1.0; });
+              }));
+  std::printf("  (checksum %g)\n", sum);
+}
+
+//
+// Sequential scans of a plain vector, of handles allocated one by one into an
+// empty heap, of handles allocated into a fragmented heap, as values created
+// over the life of a program are, and of handles allocated from a cow_slab.
+//
+
+void benchmark_slab()
+{
+  const std::size_t n = 1000000;
+  std::vector<scan_payload> values(n);
+  std::vector<copy_on_write<scan_payload>> heap;
+  std::vector<copy_on_write<scan_payload>> fragmented;
+  std::vector<copy_on_write<scan_payload>> slab_handles;
+  cow_slab<scan_payload> slab;
+  heap.reserve(n);
+  fragmented.reserve(n);
+  slab_handles.reserve(n);
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    heap.push_back(make_copy_on_write<scan_payload>());
+  }
+
+  // Free a random half of a heap full of other allocations of assorted
+  // sizes, so that the handles fill the holes left behind.
+  std::mt19937 random(42);
+  std::uniform_int_distribution<std::size_t> size(16, 512);
+  std::vector<std::unique_ptr<char[]>> others;
+  others.reserve(2 * n);
+  for (std::size_t i = 0; i < 2 * n; ++i)
+  {
+    others.emplace_back(new char[size(random)]);
+  }
+  std::shuffle(others.begin(), others.end(), random);
+  others.resize(n);
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    fragmented.push_back(make_copy_on_write<scan_payload>());
+    slab_handles.push_back(slab.make());
+  }
+  double sum = 0.0;
+
+  std::printf("sequential scan of %zu values\n", n);
+  std::printf("  std::vector<T>:                   %8.2f ms\n", time_ms([&] {
+                for (const auto& p : values)
+                {
+                  sum += p.values[0];
+                }
+              }));
+  std::printf("  make_copy_on_write:               %8.2f ms\n", time_ms([&] {
+                for (const auto& c : heap)
+                {
+                  sum += c->values[0];
+                }
+              }));
+  std::printf("  make_copy_on_write, fragmented:   %8.2f ms\n", time_ms([&] {
+                for (const auto& c : fragmented)
+                {
+                  sum += c->values[0];
+                }
+              }));
+  std::printf("  cow_slab:                         %8.2f ms\n", time_ms([&] {
+                for (const auto& c : slab_handles)
+                {
+                  sum += c->values[0];
+                }
+              }));
+  std::printf("  (checksum %g)\n", sum);
+}
+
+//
+// Detach a large vector with the default and the parallel copier. A vector
+// using default_init_allocator is not written before the parallel copy.
+//
+
+template <typename V, typename C>
+double detach_vector(C copier)
+{
+  copy_on_write<V> c(new V(8 << 20, 1.0), copier);
+  return time_ms([&] {
+    for (int i = 0; i < 4; ++i)
+    {
+      auto snapshot = c;
+      mutate(c);
+    }
+  }) / 4;
+}
+
+void benchmark_parallel_copy()
+{
+  using vector_type = std::vector<double>;
+  using default_init_vector =
+      std::vector<double, default_init_allocator<double>>;
+  std::printf("detach of a %zu MB vector (%u threads)\n",
+              (sizeof(double) << 23) >> 20, thread_count());
+  std::printf("  default_copy:                     %8.2f ms\n",
+              detach_vector<vector_type>(default_copy<vector_type>()));
+  std::printf("  parallel_copy:                    %8.2f ms\n",
+              detach_vector<vector_type>(
+                  parallel_copy<vector_type>(thread_count())));
+  std::printf("  parallel_copy, default_init:      %8.2f ms\n",
+              detach_vector<default_init_vector>(
+                  parallel_copy<default_init_vector>(thread_count())));
+}
+
+#if defined(__linux__)
+
+//
+// Snapshot a large trivially copyable value, write a few bytes to it and
+// detach.
+//
+
+struct large_payload
+{
+  double values[8 << 20];
+};
+
+template <typename Make>
+double snapshot_then_write(Make make)
+{
+  auto c = make();
+  mutate(c)->values[0] = 1.0;
+  return time_ms([&] {
+    for (int i = 0; i < 8; ++i)
+    {
+      auto snapshot = c;
+      mutate(c)->values[i * 4096] += 1.0;
+    }
+  }) / 8;
+}
+
+void benchmark_page_mapped()
+{
+  std::printf("detach of a %zu MB value after a small write\n",
+              sizeof(large_payload) >> 20);
+  std::printf("  make_copy_on_write:               %8.2f ms\n",
+              snapshot_then_write(
+                  [] { return make_copy_on_write<large_payload>(); }));
+  std::printf("  make_page_mapped_copy_on_write:   %8.2f ms\n",
+              snapshot_then_write(
+                  [] { return make_page_mapped_copy_on_write<large_payload>(); }));
+}
+
+#endif
+
+} // namespace
+
+int main()
+{
+  benchmark_false_sharing();
+  benchmark_prefetch();
+  benchmark_slab();
+  benchmark_parallel_copy();
+#if defined(__linux__)
+  benchmark_page_mapped();
+#endif
+}
@@ -1,6 +1,42 @@
 #include <memory>
 #include <type_traits>
 #include <cassert>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+#if defined(__linux__)
+#include <cerrno>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 ////////////////////////////////////////////////////////////////////////////////
 // Implementation detail classes
@@ -15,297 +51,1336 @@ struct default_copy
   }
 };
 
-template <typename T>
-struct default_delete
-{
-  void operator()(const T* t) const
-  {
-    delete t;
-  }
-};
-
-template <typename T>
-struct shared_control_block
-{
-  virtual ~shared_control_block() = default;
-  virtual std::shared_ptr<shared_control_block> clone() const = 0;
-  virtual T* ptr() = 0;
-};
+//
+// An allocator that default-initialises elements constructed without
+// arguments, so that `std::vector<T, default_init_allocator<T>>(n)` leaves
+// trivial elements unwritten.
+//
 
-template <typename T, typename U, typename C = default_copy<U>,
-          typename D = default_delete<U>>
-class indirect_shared_control_block : public shared_control_block<T>
+template <typename T, typename A = std::allocator<T>>
+class default_init_allocator : public A
 {
-  std::unique_ptr<U, D> p_;
-  C c_;
+  using traits = std::allocator_traits<A>;
 
 public:
-  explicit indirect_shared_control_block(U* u, C c = C{}, D d = D{})
-      : c_(std::move(c)), p_(u, std::move(d))
+  template <typename U>
+  struct rebind
   {
-  }
+    using other =
+        default_init_allocator<U, typename traits::template rebind_alloc<U>>;
+  };
 
-  std::shared_ptr<shared_control_block<T>> clone() const override
+  using A::A;
+
+  template <typename U>
+  void construct(U* p) noexcept(
+      std::is_nothrow_default_constructible<U>::value)
   {
-    assert(p_);
-    return std::make_shared<indirect_shared_control_block>(c_(*p_), c_,
-                                                   p_.get_deleter());
+    ::new (static_cast<void*>(p)) U;
   }
 
-  T* ptr() override
+  template <typename U, typename... Ts>
+  void construct(U* p, Ts&&... ts)
   {
-    return p_.get();
+    traits::construct(static_cast<A&>(*this), p, std::forward<Ts>(ts)...);
   }
 };
 
-template <typename T, typename U = T>
-class direct_shared_control_block : public shared_control_block<U>
-{
-  U u_;
+//
+// Copies large contiguous payloads on several threads. The destination is
+// split at page boundaries and each thread copies its own chunk; where the
+// destination has not been written yet, a first-touch NUMA policy places its
+// pages on the node of the thread that copies them. The copy itself uses
+// memcpy, which switches to non-temporal stores for large sizes. This applies
+// to trivially copyable values and to vectors of them. A vector using
+// default_init_allocator is left unwritten until the copy; any other vector is
+// value-initialised by the calling thread first, so its pages are placed there
+// and only the copy is parallel. Types with no contiguous representation are
+// copied with `new T(t)`.
+//
 
-public:
-  template <typename... Ts>
-  explicit direct_shared_control_block(Ts&&... ts) : u_(U(std::forward<Ts>(ts)...))
+inline void parallel_memcpy(void* to, const void* from, std::size_t bytes,
+                            unsigned threads)
+{
+  constexpr std::size_t min_chunk = 1 << 20;
+  constexpr std::uintptr_t page = 4096;
+  const auto n = std::min<std::size_t>(threads, bytes / min_chunk);
+  if (n <= 1)
   {
+    std::memcpy(to, from, bytes);
+    return;
   }
 
-  std::shared_ptr<shared_control_block<U>> clone() const override
+  const auto chunk = (bytes + n - 1) / n;
+  const auto base = reinterpret_cast<std::uintptr_t>(to);
+  auto boundary = [=](std::size_t i) {
+    const auto end = ((base + i * chunk + page - 1) & ~(page - 1)) - base;
+    return i == 0 ? 0 : std::min(bytes, end);
+  };
+  auto copy_chunk = [=](std::size_t i) {
+    const auto begin = boundary(i);
+    const auto end = boundary(i + 1);
+    std::memcpy(static_cast<char*>(to) + begin,
+                static_cast<const char*>(from) + begin, end - begin);
+  };
+
+  // Chunks that no thread could be started for are copied here.
+  std::vector<std::thread> workers;
+  std::size_t started = 1;
+  try
   {
-    return std::make_shared<direct_shared_control_block>(*this);
+    workers.reserve(n - 1);
+    for (; started < n; ++started)
+    {
+      workers.emplace_back(copy_chunk, started);
+    }
   }
-
-  T* ptr() override
+  catch (...)
   {
-    return &u_;
   }
-};
+  for (auto i = started; i < n; ++i)
+  {
+    copy_chunk(i);
+  }
+  copy_chunk(0);
+  for (auto& w : workers)
+  {
+    w.join();
+  }
+}
 
-template <typename T, typename U>
-class delegating_shared_control_block : public shared_control_block<T>
+template <typename T>
+std::enable_if_t<std::is_trivially_copyable<T>::value &&
+                     std::is_trivially_default_constructible<T>::value,
+                 T*>
+parallel_clone(const T& t, unsigned threads)
 {
+  // Default-initialisation leaves the pages untouched until the copy.
+  std::unique_ptr<T> p(new T);
+  parallel_memcpy(p.get(), &t, sizeof(T), threads);
+  return p.release();
+}
 
-  std::shared_ptr<shared_control_block<U>> delegate_;
+template <typename V, typename A>
+std::enable_if_t<std::is_trivially_copyable<V>::value,
+                 std::vector<V, A>*>
+parallel_clone(const std::vector<V, A>& v, unsigned threads)
+{
+  std::unique_ptr<std::vector<V, A>> p(
+      new std::vector<V, A>(v.size(), v.get_allocator()));
+  parallel_memcpy(p->data(), v.data(), v.size() * sizeof(V), threads);
+  return p.release();
+}
 
-public:
-  explicit delegating_shared_control_block(std::shared_ptr<shared_control_block<U>> b)
-      : delegate_(b)
-  {
-  }
+template <typename T, typename... Ts>
+T* parallel_clone(const T& t, unsigned, Ts...)
+{
+  return new T(t);
+}
 
-  std::shared_ptr<shared_control_block<T>> clone() const override
+template <typename T>
+struct parallel_copy
+{
+  unsigned threads;
+
+  explicit parallel_copy(unsigned n = std::thread::hardware_concurrency())
+      : threads(n ? n : 1)
   {
-    return std::make_shared<delegating_shared_control_block>(delegate_->clone());
   }
 
-  T* ptr() override
+  T* operator()(const T& t) const
   {
-    return delegate_->ptr();
+    return parallel_clone(t, threads);
   }
 };
 
 template <typename T>
-class copy_on_write;
-
-template <typename T>
-struct is_copy_on_write : std::false_type
-{
-};
-
-template <typename T>
-struct is_copy_on_write<copy_on_write<T>> : std::true_type
+struct default_delete
 {
+  void operator()(const T* t) const
+  {
+    delete t;
+  }
 };
 
-////////////////////////////////////////////////////////////////////////////////
-// `copy_on_write` class definition
-////////////////////////////////////////////////////////////////////////////////
+//
+// Runs deferred destructions on a background thread.
+//
 
-template <typename T>
-class copy_on_write
+class deferred_reclaimer
 {
-  template <typename U>
-  friend class copy_on_write;
-  template <typename T_, typename... Ts>
-  friend copy_on_write<T_> make_copy_on_write(Ts&&... ts);
-
-  T* ptr_ = nullptr;
-  std::shared_ptr<shared_control_block<T>> cb_;
-
-  void detach()
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable idle_;
+  std::deque<std::function<void()>> queue_;
+  bool busy_ = false;
+  bool stop_ = false;
+  std::thread worker_;
+
+  void run()
   {
-    cb_ = cb_->clone();
-    ptr_ = cb_->ptr();
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;)
+    {
+      work_available_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+      if (queue_.empty())
+      {
+        return;
+      }
+      auto f = std::move(queue_.front());
+      queue_.pop_front();
+      busy_ = true;
+      lock.unlock();
+      f();
+      f = nullptr;
+      lock.lock();
+      busy_ = false;
+      if (queue_.empty())
+      {
+        idle_.notify_all();
+      }
+    }
   }
 
 public:
+  deferred_reclaimer() : worker_([this] { run(); })
+  {
+  }
 
-  //
-  // Destructor
-  //
-
-  ~copy_on_write() = default;
+  deferred_reclaimer(const deferred_reclaimer&) = delete;
+  deferred_reclaimer& operator=(const deferred_reclaimer&) = delete;
 
-  //
-  // Constructors
-  //
+  // Runs any outstanding work before returning.
+  ~deferred_reclaimer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_available_.notify_one();
+    worker_.join();
+  }
 
-  copy_on_write()
+  // Never destroyed, so that values with static storage duration can still
+  // be released during program exit.
+  static deferred_reclaimer& instance()
   {
+    static auto r = new deferred_reclaimer;
+    return *r;
   }
 
-  template <typename U, typename C = default_copy<U>,
-            typename D = default_delete<U>,
-            typename V = std::enable_if_t<std::is_convertible<U*, T*>::value>>
-  explicit copy_on_write(U* u, C copier = C{}, D deleter = D{})
+  void defer(std::function<void()> f)
   {
-    if (!u)
     {
-      return;
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(f));
     }
-
-    assert(typeid(*u) == typeid(U));
-
-    cb_ = std::make_unique<indirect_shared_control_block<T, U, C, D>>(
-        u, std::move(copier), std::move(deleter));
-    ptr_ = u;
+    work_available_.notify_one();
   }
 
-  template<typename U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value && !is_copy_on_write<U>::value>>
-  copy_on_write(U u) : copy_on_write(new U(std::move(u)))
+  // Blocks until all work deferred so far has run.
+  void drain()
   {
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return queue_.empty() && !busy_; });
   }
+};
 
-  //
-  // Copy constructors
-  //
+//
+// A deleter that hands destruction to a deferred_reclaimer, keeping the cost
+// of destroying large values off the thread that releases them.
+//
 
-  copy_on_write(const copy_on_write& c) : ptr_(c.ptr_), cb_(c.cb_)
+template <typename T>
+class deferred_delete
+{
+  deferred_reclaimer* reclaimer_;
+
+public:
+  deferred_delete() : reclaimer_(&deferred_reclaimer::instance())
   {
   }
 
-  template <typename U,
-            typename V = std::enable_if_t<!std::is_same<T, U>::value &&
-                                          std::is_convertible<U*, T*>::value>>
-  copy_on_write(const copy_on_write<U>& p)
+  explicit deferred_delete(deferred_reclaimer& r) : reclaimer_(&r)
   {
-    copy_on_write<U> tmp(p);
-    ptr_ = tmp.ptr_;
-    cb_ = std::static_pointer_cast<shared_control_block<T>>(
-        std::make_shared<delegating_shared_control_block<T, U>>(
-            std::move(tmp.cb_)));
   }
 
-  //
-  // Move constructors
-  //
-
-  copy_on_write(copy_on_write&& c) : ptr_(std::move(c.ptr_)), cb_(std::move(c.cb_))
+  void operator()(const T* t) const
   {
-    c.ptr_ = nullptr;
+    reclaimer_->defer([t] { delete t; });
   }
+};
 
-  template <typename U,
-            typename V = std::enable_if_t<!std::is_same<T, U>::value &&
-                                          std::is_convertible<U*, T*>::value>>
-  copy_on_write(copy_on_write<U>&& c)
+template <typename T>
+struct payload_size
+{
+  std::size_t operator()(const T&) const
   {
-    ptr_ = c.ptr_;
-    cb_ = std::static_pointer_cast<shared_control_block<T>>(
-        std::make_shared<delegating_shared_control_block<T, U>>(
-            std::move(c.cb_)));
-    c.ptr_ = nullptr;
+    return sizeof(T);
   }
+};
 
-  //
-  // Copy assignment
-  //
+//
+// Clones started by `prepare_mutate`, keyed by the control block they were
+// made from. Kept out of the control blocks so that values which are never
+// prepared pay only for checking that the table is empty.
+//
 
-  copy_on_write& operator=(const copy_on_write& p)
+class speculative_clone_table
+{
+  struct entry
   {
-    if (&p == this)
+    std::weak_ptr<void> source;
+    std::shared_future<std::shared_ptr<void>> clone;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<const void*, entry> entries_;
+  std::atomic<std::size_t> size_{0};
+
+  // An entry whose source has been released may share its key with a new
+  // block, so entries are matched by owner as well as by address. A clone is
+  // only ever destroyed outside the lock, as its own destructor looks in the
+  // table.
+  template <typename U>
+  std::shared_future<std::shared_ptr<void>>
+  remove(const std::shared_ptr<U>& source)
+  {
+    auto removed = remove(static_cast<const void*>(source.get()));
+    if (removed.source.owner_before(source) ||
+        source.owner_before(removed.source))
     {
-      return *this;
+      return {};
     }
+    return std::move(removed.clone);
+  }
 
-    if (!p)
+  entry remove(const void* source)
+  {
+    entry removed;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(source);
+    if (it != entries_.end())
     {
-      cb_.reset();
-      ptr_ = nullptr;
-      return *this;
+      removed = std::move(it->second);
+      entries_.erase(it);
+      size_.store(entries_.size(), std::memory_order_relaxed);
     }
-
-    auto tmp_cb = p.cb_->clone();
-    ptr_ = tmp_cb->ptr();
-    cb_ = std::move(tmp_cb);
-    return *this;
+    return removed;
   }
 
-  template <typename U,
-            typename V = std::enable_if_t<!std::is_same<T, U>::value &&
-                                          std::is_convertible<U*, T*>::value>>
-  copy_on_write& operator=(const copy_on_write<U>& p)
+public:
+  // Never destroyed, so that clones finishing during program exit can still
+  // be recorded.
+  static speculative_clone_table& instance()
   {
-    copy_on_write<U> tmp(p);
-    *this = std::move(tmp);
-    return *this;
+    static auto t = new speculative_clone_table;
+    return *t;
   }
 
-  template <typename U,
-            typename V = std::enable_if_t<std::is_convertible<U*, T*>::value &&
-                                          !is_copy_on_write<U>::value>>
-  copy_on_write& operator=(const U& u)
+  bool empty() const
   {
-    copy_on_write tmp(u);
-    *this = std::move(tmp);
-    return *this;
+    return size_.load(std::memory_order_relaxed) == 0;
   }
 
-
-  //
-  // Move assignment
-  //
-
-  copy_on_write& operator=(copy_on_write&& p) noexcept
+  // Records `clone` as being made from `source`, unless a clone of it is
+  // already pending. Entries for released sources are swept out.
+  template <typename U>
+  bool insert(const std::shared_ptr<U>& source,
+              std::shared_future<std::shared_ptr<void>> clone)
   {
-    if (&p == this)
+    std::vector<entry> released;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = entries_.begin(); it != entries_.end();)
     {
-      return *this;
+      if (it->second.source.expired())
+      {
+        released.push_back(std::move(it->second));
+        it = entries_.erase(it);
+      }
+      else
+      {
+        ++it;
+      }
     }
-
-    cb_ = std::move(p.cb_);
-    ptr_ = p.ptr_;
-    p.ptr_ = nullptr;
-    return *this;
+    auto inserted = entries_.emplace(
+        source.get(), entry{std::weak_ptr<U>(source), std::move(clone)});
+    size_.store(entries_.size(), std::memory_order_relaxed);
+    return inserted.second;
   }
 
-  template <typename U,
-            typename V = std::enable_if_t<!std::is_same<T, U>::value &&
-                                          std::is_convertible<U*, T*>::value>>
-  copy_on_write& operator=(copy_on_write<U>&& p)
+  // Removes the clone made from `source`, returning it if it is ready.
+  template <typename U>
+  std::shared_ptr<U> take(const std::shared_ptr<U>& source)
   {
-    cb_ = std::make_unique<delegating_shared_control_block<T, U>>(std::move(p.cb_));
-    ptr_ = p.ptr_;
-    p.ptr_ = nullptr;
-    return *this;
+    auto clone = remove(source);
+    if (clone.valid() &&
+        clone.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+    {
+      return std::static_pointer_cast<U>(clone.get());
+    }
+    return nullptr;
   }
 
-  template <typename U,
-            typename V = std::enable_if_t<std::is_convertible<U*, T*>::value &&
-                                          !is_copy_on_write<U>::value>>
-  copy_on_write& operator=(U&& u)
+  template <typename U>
+  void erase(const std::shared_ptr<U>& source)
   {
-    copy_on_write tmp(std::move(u));
-    *this = std::move(tmp);
-    return *this;
+    remove(source);
   }
 
-  //
-  // Modifiers
-  //
-
-  void swap(copy_on_write& c) noexcept
+  // Drops any clone made from a control block that is being destroyed.
+  void release(const void* source)
   {
-    using std::swap;
+    remove(source);
+  }
+};
+
+//
+// Versions are handed out in ranges, one to each new control block, so that
+// no two blocks ever hold the same version. A block mutated in place counts up
+// through its range and takes a new one when it runs out, so the shared
+// counter is touched once per block rather than once per mutation.
+//
+
+constexpr std::uint64_t version_range_size = std::uint64_t(1) << 10;
+
+inline std::uint64_t new_version_range()
+{
+  // Version 0 is left for empty handles.
+  static std::atomic<std::uint64_t> next{version_range_size};
+  return next.fetch_add(version_range_size, std::memory_order_relaxed);
+}
+
+template <typename T>
+struct shared_control_block
+{
+  // Bit 0 is set once a weak handle has observed the block; the version is
+  // kept in the bits above it. Only changed through a unique handle, but read
+  // concurrently by weak handles.
+  static constexpr std::uint64_t weakly_observed = 1;
+  std::atomic<std::uint64_t> stamp_{new_version_range() << 1};
+
+  shared_control_block() = default;
+
+  // A clone starts unobserved, with a version range of its own.
+  shared_control_block(const shared_control_block&)
+  {
+  }
+
+  shared_control_block& operator=(const shared_control_block&) = delete;
+
+  // A clone prepared from the block but never taken goes with it.
+  virtual ~shared_control_block()
+  {
+    auto& speculative = speculative_clone_table::instance();
+    if (!speculative.empty())
+    {
+      speculative.release(this);
+    }
+  }
+  virtual std::shared_ptr<shared_control_block> clone() const = 0;
+  virtual T* ptr() = 0;
+
+  // The block that owns the value, looking through any delegation.
+  virtual const void* identity() const
+  {
+    return this;
+  }
+
+  std::uint64_t version() const
+  {
+    return stamp_.load(std::memory_order_relaxed) >> 1;
+  }
+
+  void set_version(std::uint64_t v)
+  {
+    stamp_.store(v << 1, std::memory_order_relaxed);
+  }
+
+  // The stamp that follows `stamp` after a mutation in place.
+  static std::uint64_t next_stamp(std::uint64_t stamp)
+  {
+    if ((stamp >> 1) % version_range_size == version_range_size - 1)
+    {
+      return (new_version_range() << 1) | (stamp & weakly_observed);
+    }
+    return stamp + 2;
+  }
+};
+
+template <typename T, typename U, typename C = default_copy<U>,
+          typename D = default_delete<U>>
+class indirect_shared_control_block : public shared_control_block<T>
+{
+  std::unique_ptr<U, D> p_;
+  C c_;
+
+public:
+  explicit indirect_shared_control_block(U* u, C c = C{}, D d = D{})
+      : c_(std::move(c)), p_(u, std::move(d))
+  {
+  }
+
+  std::shared_ptr<shared_control_block<T>> clone() const override
+  {
+    assert(p_);
+    return std::make_shared<indirect_shared_control_block>(c_(*p_), c_,
+                                                   p_.get_deleter());
+  }
+
+  T* ptr() override
+  {
+    return p_.get();
+  }
+};
+
+template <typename T, typename U = T>
+class direct_shared_control_block : public shared_control_block<U>
+{
+  U u_;
+
+public:
+  template <typename... Ts>
+  explicit direct_shared_control_block(Ts&&... ts) : u_(U(std::forward<Ts>(ts)...))
+  {
+  }
+
+  std::shared_ptr<shared_control_block<U>> clone() const override
+  {
+    return std::make_shared<direct_shared_control_block>(*this);
+  }
+
+  T* ptr() override
+  {
+    return &u_;
+  }
+};
+
+// Assumed size of a cache line, used to keep frequently written reference
+// counts away from payloads that are only read.
+constexpr std::size_t cache_line_size = 64;
+
+template <typename T>
+class cache_aligned_shared_control_block : public shared_control_block<T>
+{
+  // The padding keeps the payload off the cache lines holding the shared_ptr
+  // counts before it and any neighbouring allocation after it.
+  char leading_padding_[cache_line_size];
+  T t_;
+  char trailing_padding_[cache_line_size];
+
+public:
+  template <typename... Ts>
+  explicit cache_aligned_shared_control_block(Ts&&... ts)
+      : t_(std::forward<Ts>(ts)...)
+  {
+  }
+
+  cache_aligned_shared_control_block(
+      const cache_aligned_shared_control_block& b)
+      : shared_control_block<T>(), t_(b.t_)
+  {
+  }
+
+  std::shared_ptr<shared_control_block<T>> clone() const override
+  {
+    return std::make_shared<cache_aligned_shared_control_block>(*this);
+  }
+
+  T* ptr() override
+  {
+    return &t_;
+  }
+};
+
+//
+// Fixed-size slots carved out of contiguous pages. The slot size is set by the
+// first allocation. Pages are aligned to their size and start with a pointer
+// to their pool, so the pool that owns a slot is found from its address and
+// nothing else needs to be stored per slot. The pool deletes itself once it
+// has been released by its owner and the last slot has been returned.
+//
+
+class slab_pool
+{
+  struct page_header
+  {
+    slab_pool* pool;
+  };
+
+  static constexpr std::size_t page_bytes = std::size_t(1) << 16;
+  static constexpr std::size_t header_bytes =
+      (sizeof(page_header) + alignof(std::max_align_t) - 1) /
+      alignof(std::max_align_t) * alignof(std::max_align_t);
+
+  struct page_delete
+  {
+    void operator()(char* page) const
+    {
+#if defined(_WIN32)
+      _aligned_free(page);
+#else
+      std::free(page);
+#endif
+    }
+  };
+
+  std::mutex mutex_;
+  std::size_t slots_per_page_;
+  std::size_t slot_size_ = 0;
+  std::vector<std::unique_ptr<char, page_delete>> pages_;
+  char* page_ = nullptr;
+  std::size_t next_slot_ = 0;
+  void* free_list_ = nullptr;
+  std::size_t slots_in_use_ = 0;
+  bool released_ = false;
+
+  ~slab_pool() = default;
+
+  static slab_pool*& allocation_target()
+  {
+    static thread_local slab_pool* pool = nullptr;
+    return pool;
+  }
+
+  char* new_page()
+  {
+    pages_.reserve(pages_.size() + 1);
+#if defined(_WIN32)
+    auto page = static_cast<char*>(_aligned_malloc(page_bytes, page_bytes));
+#else
+    void* memory = nullptr;
+    auto page = posix_memalign(&memory, page_bytes, page_bytes) == 0
+                    ? static_cast<char*>(memory)
+                    : nullptr;
+#endif
+    if (!page)
+    {
+      throw std::bad_alloc();
+    }
+    pages_.emplace_back(page);
+    reinterpret_cast<page_header*>(page)->pool = this;
+    return page;
+  }
+
+public:
+  // Slots per page; 0 fills each page.
+  explicit slab_pool(std::size_t slots_per_page)
+      : slots_per_page_(slots_per_page)
+  {
+  }
+
+  slab_pool(const slab_pool&) = delete;
+  slab_pool& operator=(const slab_pool&) = delete;
+
+  // Directs allocations by slab_allocator on this thread to a pool.
+  class target_scope
+  {
+    slab_pool* previous_;
+
+  public:
+    explicit target_scope(slab_pool* pool) : previous_(allocation_target())
+    {
+      allocation_target() = pool;
+    }
+
+    target_scope(const target_scope&) = delete;
+    target_scope& operator=(const target_scope&) = delete;
+
+    ~target_scope()
+    {
+      allocation_target() = previous_;
+    }
+  };
+
+  static slab_pool* target()
+  {
+    return allocation_target();
+  }
+
+  static slab_pool* owner_of(const void* p)
+  {
+    const auto page = reinterpret_cast<std::uintptr_t>(p) & ~(page_bytes - 1);
+    return reinterpret_cast<const page_header*>(page)->pool;
+  }
+
+  void release()
+  {
+    bool last = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      released_ = true;
+      last = slots_in_use_ == 0;
+    }
+    if (last)
+    {
+      delete this;
+    }
+  }
+
+  void* allocate(std::size_t bytes)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (slot_size_ == 0)
+    {
+      const auto align = alignof(std::max_align_t);
+      slot_size_ = (std::max(bytes, sizeof(void*)) + align - 1) / align * align;
+      const auto fit = (page_bytes - header_bytes) / slot_size_;
+      slots_per_page_ =
+          slots_per_page_ ? std::min(slots_per_page_, fit) : fit;
+      next_slot_ = slots_per_page_;
+    }
+    if (bytes > slot_size_ || slots_per_page_ == 0)
+    {
+      throw std::bad_alloc();
+    }
+
+    void* p = nullptr;
+    if (free_list_)
+    {
+      p = free_list_;
+      free_list_ = *static_cast<void**>(p);
+    }
+    else
+    {
+      if (next_slot_ == slots_per_page_)
+      {
+        page_ = new_page();
+        next_slot_ = 0;
+      }
+      p = page_ + header_bytes + slot_size_ * next_slot_++;
+    }
+    ++slots_in_use_;
+    return p;
+  }
+
+  void deallocate(void* p)
+  {
+    bool last = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      *static_cast<void**>(p) = free_list_;
+      free_list_ = p;
+      last = --slots_in_use_ == 0 && released_;
+    }
+    if (last)
+    {
+      delete this;
+    }
+  }
+
+  std::size_t page_count()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pages_.size();
+  }
+
+  std::size_t slots_in_use()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return slots_in_use_;
+  }
+};
+
+// Allocates from the pool targeted on the calling thread and returns slots to
+// the pool that owns them. Being stateless, it takes no space in the
+// shared_ptr control blocks it allocates.
+template <typename T>
+struct slab_allocator
+{
+  using value_type = T;
+
+  slab_allocator() = default;
+
+  template <typename U>
+  slab_allocator(const slab_allocator<U>&)
+  {
+  }
+
+  T* allocate(std::size_t n)
+  {
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "over-aligned types are not supported");
+    assert(slab_pool::target());
+    return static_cast<T*>(slab_pool::target()->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t)
+  {
+    slab_pool::owner_of(p)->deallocate(p);
+  }
+
+  template <typename U>
+  bool operator==(const slab_allocator<U>&) const
+  {
+    return true;
+  }
+
+  template <typename U>
+  bool operator!=(const slab_allocator<U>&) const
+  {
+    return false;
+  }
+};
+
+template <typename T>
+class slab_shared_control_block : public shared_control_block<T>
+{
+  T t_;
+
+public:
+  template <typename... Ts>
+  explicit slab_shared_control_block(Ts&&... ts)
+      : t_(std::forward<Ts>(ts)...)
+  {
+  }
+
+  slab_shared_control_block(const slab_shared_control_block& b)
+      : shared_control_block<T>(), t_(b.t_)
+  {
+  }
+
+  std::shared_ptr<shared_control_block<T>> clone() const override
+  {
+    slab_pool::target_scope scope(slab_pool::owner_of(this));
+    return std::allocate_shared<slab_shared_control_block>(
+        slab_allocator<slab_shared_control_block>(), *this);
+  }
+
+  T* ptr() override
+  {
+    return &t_;
+  }
+};
+
+#if defined(__linux__)
+
+//
+// Page-level copy-on-write through the kernel. The initial value is written to
+// a memfd which is never modified again; every control block maps it with
+// MAP_PRIVATE, so writes only copy the pages they touch. A clone maps the file
+// afresh and copies over just the pages its source has written, which are
+// found through /proc/self/pagemap.
+//
+
+class memfd_image
+{
+  int fd_;
+  std::size_t size_;
+
+public:
+  explicit memfd_image(std::size_t size)
+      : fd_(memfd_create("copy_on_write", MFD_CLOEXEC)), size_(size)
+  {
+    if (fd_ < 0)
+    {
+      throw std::system_error(errno, std::generic_category(), "memfd_create");
+    }
+    if (ftruncate(fd_, off_t(size_)) != 0)
+    {
+      auto e = errno;
+      close(fd_);
+      throw std::system_error(e, std::generic_category(), "ftruncate");
+    }
+  }
+
+  memfd_image(const memfd_image&) = delete;
+  memfd_image& operator=(const memfd_image&) = delete;
+
+  ~memfd_image()
+  {
+    close(fd_);
+  }
+
+  int fd() const
+  {
+    return fd_;
+  }
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+};
+
+inline std::size_t system_page_size()
+{
+  static const auto size = std::size_t(sysconf(_SC_PAGESIZE));
+  return size;
+}
+
+// Calls `f(offset)` for each page of [p, p + length) that is no longer backed
+// by the file it maps, or for every page if that cannot be determined.
+template <typename F>
+void for_each_private_page(const void* p, std::size_t length, F f)
+{
+  const auto page = system_page_size();
+  const auto pages = length / page;
+  const int fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+
+  const std::uint64_t present = std::uint64_t(1) << 63;
+  const std::uint64_t swapped = std::uint64_t(1) << 62;
+  const std::uint64_t file = std::uint64_t(1) << 61;
+
+  std::uint64_t entries[512];
+  const auto first = reinterpret_cast<std::uintptr_t>(p) / page;
+  for (std::size_t i = 0; i < pages; i += 512)
+  {
+    const auto n = std::min<std::size_t>(512, pages - i);
+    const auto bytes = n * sizeof(std::uint64_t);
+    if (fd < 0 ||
+        pread(fd, entries, bytes, off_t((first + i) * sizeof(std::uint64_t))) !=
+            ssize_t(bytes))
+    {
+      std::fill(entries, entries + n, present);
+    }
+    for (std::size_t j = 0; j < n; ++j)
+    {
+      if ((entries[j] & (present | swapped)) && !(entries[j] & file))
+      {
+        f((i + j) * page);
+      }
+    }
+  }
+
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+}
+
+template <typename T>
+class page_mapped_shared_control_block : public shared_control_block<T>
+{
+  static_assert(std::is_trivially_copyable<T>::value,
+                "page-mapped values must be trivially copyable");
+
+  std::shared_ptr<const memfd_image> image_;
+  void* map_ = nullptr;
+
+  void* map(int flags, void* address = nullptr)
+  {
+    auto p = mmap(address, image_->size(), PROT_READ | PROT_WRITE, flags,
+                  image_->fd(), 0);
+    if (p == MAP_FAILED)
+    {
+      throw std::system_error(errno, std::generic_category(), "mmap");
+    }
+    return p;
+  }
+
+  explicit page_mapped_shared_control_block(
+      std::shared_ptr<const memfd_image> image)
+      : image_(std::move(image)), map_(map(MAP_PRIVATE))
+  {
+  }
+
+public:
+  template <typename... Ts>
+  explicit page_mapped_shared_control_block(Ts&&... ts)
+  {
+    const auto page = system_page_size();
+    image_ = std::make_shared<const memfd_image>((sizeof(T) + page - 1) /
+                                                 page * page);
+
+    // Write the initial value through a shared mapping, then replace it with
+    // a private mapping of the same file at the same address.
+    map_ = map(MAP_SHARED);
+    try
+    {
+      new (map_) T(std::forward<Ts>(ts)...);
+      map(MAP_PRIVATE | MAP_FIXED, map_);
+    }
+    catch (...)
+    {
+      munmap(map_, image_->size());
+      throw;
+    }
+  }
+
+  page_mapped_shared_control_block(const page_mapped_shared_control_block&) =
+      delete;
+
+  ~page_mapped_shared_control_block()
+  {
+    munmap(map_, image_->size());
+  }
+
+  std::shared_ptr<shared_control_block<T>> clone() const override
+  {
+    std::shared_ptr<page_mapped_shared_control_block> b(
+        new page_mapped_shared_control_block(image_));
+    auto from = static_cast<const char*>(map_);
+    auto to = static_cast<char*>(b->map_);
+    const auto page = system_page_size();
+    for_each_private_page(map_, image_->size(), [&](std::size_t offset) {
+      std::memcpy(to + offset, from + offset, page);
+    });
+    return b;
+  }
+
+  T* ptr() override
+  {
+    return static_cast<T*>(map_);
+  }
+};
+
+class mapped_file
+{
+  void* p_ = nullptr;
+  std::size_t size_ = 0;
+
+public:
+  explicit mapped_file(const std::string& path)
+  {
+    const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+      auto e = errno;
+      close(fd);
+      throw std::system_error(e, std::generic_category(), path);
+    }
+    size_ = std::size_t(st.st_size);
+    if (size_ != 0)
+    {
+      // A private writable mapping: pages written through a unique handle
+      // are copied by the kernel and never reach the file.
+      p_ = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    auto e = errno;
+    close(fd);
+    if (p_ == MAP_FAILED)
+    {
+      throw std::system_error(e, std::generic_category(), path);
+    }
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  ~mapped_file()
+  {
+    if (p_)
+    {
+      munmap(p_, size_);
+    }
+  }
+
+  char* data() const
+  {
+    return static_cast<char*>(p_);
+  }
+
+  std::size_t size() const
+  {
+    return size_;
+  }
+};
+
+template <typename T>
+class mapped_shared_control_block : public shared_control_block<T>
+{
+  std::shared_ptr<const mapped_file> file_;
+  T* t_;
+
+public:
+  mapped_shared_control_block(std::shared_ptr<const mapped_file> file, T* t)
+      : file_(std::move(file)), t_(t)
+  {
+  }
+
+  std::shared_ptr<shared_control_block<T>> clone() const override
+  {
+    return std::make_shared<direct_shared_control_block<T>>(*t_);
+  }
+
+  T* ptr() override
+  {
+    return t_;
+  }
+};
+
+#endif
+
+template <typename T, typename U>
+class delegating_shared_control_block : public shared_control_block<T>
+{
+
+  std::shared_ptr<shared_control_block<U>> delegate_;
+
+public:
+  explicit delegating_shared_control_block(std::shared_ptr<shared_control_block<U>> b)
+      : delegate_(b)
+  {
+    this->set_version(delegate_->version());
+  }
+
+  std::shared_ptr<shared_control_block<T>> clone() const override
+  {
+    return std::make_shared<delegating_shared_control_block>(delegate_->clone());
+  }
+
+  const void* identity() const override
+  {
+    return delegate_->identity();
+  }
+
+  T* ptr() override
+  {
+    return delegate_->ptr();
+  }
+};
+
+template <typename T>
+class copy_on_write;
+
+struct memory_usage_report
+{
+  // Sum of the payload sizes of all handles, as if nothing were shared.
+  std::size_t total = 0;
+  // Each distinct value counted once.
+  std::size_t deduplicated = 0;
+  // Values referenced only by the handles examined: the bytes that releasing
+  // those handles would free.
+  std::size_t exclusive = 0;
+};
+
+template <typename It, typename S>
+memory_usage_report memory_usage(It first, It last, S size);
+
+template <typename T>
+struct is_copy_on_write : std::false_type
+{
+};
+
+template <typename T>
+struct is_copy_on_write<copy_on_write<T>> : std::true_type
+{
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// `copy_on_write` class definition
+////////////////////////////////////////////////////////////////////////////////
+
+template <typename T>
+class copy_on_write
+{
+  template <typename U>
+  friend class copy_on_write;
+  template <typename U>
+  friend class epoch_copy_on_write;
+  template <typename U>
+  friend class cow_slab;
+  template <typename U>
+  friend class cow_image;
+  template <typename U>
+  friend class weak_copy_on_write;
+  template <typename It, typename S>
+  friend memory_usage_report memory_usage(It first, It last, S size);
+  template <typename U, typename Executor>
+  friend void prepare_mutate(const copy_on_write<U>& c, Executor executor);
+  template <typename T_, typename... Ts>
+  friend copy_on_write<T_> make_copy_on_write(Ts&&... ts);
+  template <typename T_, typename... Ts>
+  friend copy_on_write<T_> make_cache_aligned_copy_on_write(Ts&&... ts);
+  template <typename T_, typename... Ts>
+  friend copy_on_write<T_> make_page_mapped_copy_on_write(Ts&&... ts);
+
+  T* ptr_ = nullptr;
+  std::shared_ptr<shared_control_block<T>> cb_;
+
+  void detach()
+  {
+    std::shared_ptr<shared_control_block<T>> b;
+    auto& speculative = speculative_clone_table::instance();
+    if (!speculative.empty())
+    {
+      b = speculative.take(cb_);
+    }
+    if (!b)
+    {
+      b = cb_->clone();
+    }
+    cb_ = std::move(b);
+    ptr_ = cb_->ptr();
+  }
+
+public:
+
+  //
+  // Destructor
+  //
+
+  ~copy_on_write() = default;
+
+  //
+  // Constructors
+  //
+
+  copy_on_write()
+  {
+  }
+
+  template <typename U, typename C = default_copy<U>,
+            typename D = default_delete<U>,
+            typename V = std::enable_if_t<std::is_convertible<U*, T*>::value>>
+  explicit copy_on_write(U* u, C copier = C{}, D deleter = D{})
+  {
+    if (!u)
+    {
+      return;
+    }
+
+    assert(typeid(*u) == typeid(U));
+
+    cb_ = std::make_unique<indirect_shared_control_block<T, U, C, D>>(
+        u, std::move(copier), std::move(deleter));
+    ptr_ = u;
+  }
+
+  template<typename U, typename = std::enable_if_t<std::is_convertible<U*, T*>::value && !is_copy_on_write<U>::value>>
+  copy_on_write(U u) : copy_on_write(new U(std::move(u)))
+  {
+  }
+
+  //
+  // Copy constructors
+  //
+
+  copy_on_write(const copy_on_write& c)
+      : ptr_(c.ptr_), cb_(c.cb_)
+  {
+  }
+
+  template <typename U,
+            typename V = std::enable_if_t<!std::is_same<T, U>::value &&
+                                          std::is_convertible<U*, T*>::value>>
+  copy_on_write(const copy_on_write<U>& p)
+  {
+    copy_on_write<U> tmp(p);
+    ptr_ = tmp.ptr_;
+    cb_ = std::static_pointer_cast<shared_control_block<T>>(
+        std::make_shared<delegating_shared_control_block<T, U>>(
+            std::move(tmp.cb_)));
+  }
+
+  //
+  // Move constructors
+  //
+
+  copy_on_write(copy_on_write&& c)
+      : ptr_(std::move(c.ptr_)), cb_(std::move(c.cb_))
+  {
+    c.ptr_ = nullptr;
+  }
+
+  template <typename U,
+            typename V = std::enable_if_t<!std::is_same<T, U>::value &&
+                                          std::is_convertible<U*, T*>::value>>
+  copy_on_write(copy_on_write<U>&& c)
+  {
+    ptr_ = c.ptr_;
+    cb_ = std::static_pointer_cast<shared_control_block<T>>(
+        std::make_shared<delegating_shared_control_block<T, U>>(
+            std::move(c.cb_)));
+    c.ptr_ = nullptr;
+  }
+
+  //
+  // Copy assignment
+  //
+
+  copy_on_write& operator=(const copy_on_write& p)
+  {
+    if (&p == this)
+    {
+      return *this;
+    }
+
+    if (!p)
+    {
+      cb_.reset();
+      ptr_ = nullptr;
+      return *this;
+    }
+
+    auto tmp_cb = p.cb_->clone();
+    ptr_ = tmp_cb->ptr();
+    cb_ = std::move(tmp_cb);
+    return *this;
+  }
+
+  template <typename U,
+            typename V = std::enable_if_t<!std::is_same<T, U>::value &&
+                                          std::is_convertible<U*, T*>::value>>
+  copy_on_write& operator=(const copy_on_write<U>& p)
+  {
+    copy_on_write<U> tmp(p);
+    *this = std::move(tmp);
+    return *this;
+  }
+
+  template <typename U,
+            typename V = std::enable_if_t<std::is_convertible<U*, T*>::value &&
+                                          !is_copy_on_write<U>::value>>
+  copy_on_write& operator=(const U& u)
+  {
+    copy_on_write tmp(u);
+    *this = std::move(tmp);
+    return *this;
+  }
+
+
+  //
+  // Move assignment
+  //
+
+  copy_on_write& operator=(copy_on_write&& p) noexcept
+  {
+    if (&p == this)
+    {
+      return *this;
+    }
+
+    cb_ = std::move(p.cb_);
+    ptr_ = p.ptr_;
+    p.ptr_ = nullptr;
+    return *this;
+  }
+
+  template <typename U,
+            typename V = std::enable_if_t<!std::is_same<T, U>::value &&
+                                          std::is_convertible<U*, T*>::value>>
+  copy_on_write& operator=(copy_on_write<U>&& p)
+  {
+    cb_ = std::make_unique<delegating_shared_control_block<T, U>>(std::move(p.cb_));
+    ptr_ = p.ptr_;
+    p.ptr_ = nullptr;
+    return *this;
+  }
+
+  template <typename U,
+            typename V = std::enable_if_t<std::is_convertible<U*, T*>::value &&
+                                          !is_copy_on_write<U>::value>>
+  copy_on_write& operator=(U&& u)
+  {
+    copy_on_write tmp(std::move(u));
+    *this = std::move(tmp);
+    return *this;
+  }
+
+  //
+  // Modifiers
+  //
+
+  void swap(copy_on_write& c) noexcept
+  {
+    using std::swap;
     swap(ptr_, c.ptr_);
     swap(cb_, c.cb_);
   }
@@ -317,64 +1392,1915 @@ public:
 
   explicit operator bool() const
   {
-    return bool(ptr_);
+    return bool(ptr_);
+  }
+
+  bool unique() const
+  {
+    return cb_.unique();
+  }
+
+  long use_count() const
+  {
+    return cb_.use_count();
+  }
+
+  // Changes on every call to `mutate`. Versions are never reused, even by
+  // control blocks allocated where an earlier one was freed, so a value is
+  // unchanged exactly while its version is; copies share the version. Empty
+  // handles have version 0.
+  std::uint64_t version() const
+  {
+    return cb_ ? cb_->version() : 0;
+  }
+
+  // Handles share a value exactly when their identities are equal.
+  const void* identity() const
+  {
+    return cb_ ? cb_->identity() : nullptr;
+  }
+
+  const T& operator*() const
+  {
+    assert(ptr_);
+    return *ptr_;
+  }
+
+  const T* operator->() const
+  {
+    assert(ptr_);
+    return ptr_;
+  }
+  
+  const T& value() const
+  {
+    return *ptr_;
+  }
+
+  //
+  // Mutator
+  //
+
+  friend T* mutate(copy_on_write& c)
+  {
+    if ( c.ptr_ && ! c.cb_.unique() )
+    {
+      c.detach();
+    }
+    else if (c.ptr_)
+    {
+      using block = shared_control_block<T>;
+      const auto stamp = c.cb_->stamp_.load(std::memory_order_relaxed);
+      if (stamp & block::weakly_observed)
+      {
+        // A weak handle may be locking the block. Either it sees the new
+        // version and gives up, or the fences order its new reference before
+        // the uniqueness check below and the value is detached instead.
+        c.cb_->stamp_.store(block::next_stamp(stamp),
+                            std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!c.cb_.unique())
+        {
+          c.detach();
+          return c.ptr_;
+        }
+      }
+      else
+      {
+        c.cb_->stamp_.store(block::next_stamp(stamp),
+                            std::memory_order_relaxed);
+      }
+      auto& speculative = speculative_clone_table::instance();
+      if (!speculative.empty())
+      {
+        speculative.erase(c.cb_);
+      }
+    }
+    return c.ptr_;
+  }
+
+  //
+  // Prefetch
+  //
+
+  // Hint that the payload and control block will be accessed soon.
+  friend void prefetch(const copy_on_write& c)
+  {
+#if defined(__GNUC__)
+    __builtin_prefetch(c.ptr_);
+    __builtin_prefetch(c.cb_.get());
+#endif
+  }
+
+  //
+  // non-member swap
+  //
+
+  friend void swap(copy_on_write& t, copy_on_write& u) noexcept
+  {
+    t.swap(u);
+  }
+};
+
+//
+// copy_on_write creation
+//
+
+template <typename T, typename... Ts>
+copy_on_write<T> make_copy_on_write(Ts&&... ts)
+{
+  copy_on_write<T> p;
+  p.cb_ = std::make_unique<direct_shared_control_block<T>>(std::forward<Ts>(ts)...);
+  p.ptr_ = p.cb_->ptr();
+  return std::move(p);
+}
+
+//
+// Places the payload on cache lines of its own so that threads which only
+// read the value do not contend with threads copying or releasing handles.
+//
+
+template <typename T, typename... Ts>
+copy_on_write<T> make_cache_aligned_copy_on_write(Ts&&... ts)
+{
+  copy_on_write<T> p;
+  p.cb_ = std::make_shared<cache_aligned_shared_control_block<T>>(
+      std::forward<Ts>(ts)...);
+  p.ptr_ = p.cb_->ptr();
+  return p;
+}
+
+//
+// The value and its clones are destroyed by the background reclaimer rather
+// than by the thread that releases the last handle.
+//
+
+template <typename T, typename... Ts>
+copy_on_write<T> make_deferred_copy_on_write(Ts&&... ts)
+{
+  return copy_on_write<T>(new T(std::forward<Ts>(ts)...), default_copy<T>{},
+                          deferred_delete<T>{});
+}
+
+#if defined(__linux__)
+
+//
+// For large trivially copyable values: detaching copies only the pages that
+// have been written since the value was created, rather than the whole value.
+//
+
+template <typename T, typename... Ts>
+copy_on_write<T> make_page_mapped_copy_on_write(Ts&&... ts)
+{
+  copy_on_write<T> p;
+  p.cb_ = std::make_shared<page_mapped_shared_control_block<T>>(
+      std::forward<Ts>(ts)...);
+  p.ptr_ = p.cb_->ptr();
+  return p;
+}
+
+#endif
+
+
+////////////////////////////////////////////////////////////////////////////////
+// `cow_slab` class definition
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Creates copy_on_write values whose control blocks and payloads live
+// contiguously in slab pages. Clones made by `mutate` are allocated from the
+// same slab and released slots are recycled. The pages are kept alive until
+// the last value is released, so a slab may be destroyed before the values it
+// created.
+//
+
+template <typename T>
+class cow_slab
+{
+  slab_pool* pool_;
+
+public:
+  // By default each page is filled with as many slots as fit.
+  explicit cow_slab(std::size_t slots_per_page = 0)
+      : pool_(new slab_pool(slots_per_page))
+  {
+  }
+
+  ~cow_slab()
+  {
+    if (pool_)
+    {
+      pool_->release();
+    }
+  }
+
+  cow_slab(const cow_slab&) = delete;
+  cow_slab& operator=(const cow_slab&) = delete;
+
+  cow_slab(cow_slab&& s) : pool_(s.pool_)
+  {
+    s.pool_ = nullptr;
+  }
+
+  cow_slab& operator=(cow_slab&& s) noexcept
+  {
+    std::swap(pool_, s.pool_);
+    return *this;
+  }
+
+  template <typename... Ts>
+  copy_on_write<T> make(Ts&&... ts)
+  {
+    assert(pool_);
+    slab_pool::target_scope scope(pool_);
+    copy_on_write<T> p;
+    p.cb_ = std::allocate_shared<slab_shared_control_block<T>>(
+        slab_allocator<T>(), std::forward<Ts>(ts)...);
+    p.ptr_ = p.cb_->ptr();
+    return p;
+  }
+
+  std::size_t page_count() const
+  {
+    return pool_->page_count();
+  }
+
+  std::size_t slots_in_use() const
+  {
+    return pool_->slots_in_use();
+  }
+};
+
+#if defined(__linux__)
+
+////////////////////////////////////////////////////////////////////////////////
+// Persistent images of copy_on_write values
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// An image file holds a header, one block index per handle (or ~0 for an
+// empty handle) and then each distinct value once. Handles that shared a value
+// when saved share it again when loaded. Values must be trivially copyable and
+// hold no pointers.
+//
+
+struct cow_image_header
+{
+  char magic[8];
+  std::uint64_t value_size;
+  std::uint64_t value_alignment;
+  std::uint64_t handle_count;
+  std::uint64_t block_count;
+  std::uint64_t values_offset;
+};
+
+constexpr char cow_image_magic[8] = {'C', 'O', 'W', 'I', 'M', 'G', '1', '\0'};
+
+template <typename It>
+void save_cow_image(const std::string& path, It first, It last)
+{
+  using T = std::decay_t<decltype(**first)>;
+  static_assert(std::is_trivially_copyable<T>::value,
+                "image values must be trivially copyable");
+
+  const auto empty = std::numeric_limits<std::uint64_t>::max();
+  std::unordered_map<const T*, std::uint64_t> block_index;
+  std::vector<const T*> blocks;
+  std::vector<std::uint64_t> indices;
+  for (; first != last; ++first)
+  {
+    if (!*first)
+    {
+      indices.push_back(empty);
+      continue;
+    }
+    const T* p = &**first;
+    auto inserted = block_index.emplace(p, blocks.size());
+    if (inserted.second)
+    {
+      blocks.push_back(p);
+    }
+    indices.push_back(inserted.first->second);
+  }
+
+  cow_image_header h;
+  std::memcpy(h.magic, cow_image_magic, sizeof(h.magic));
+  h.value_size = sizeof(T);
+  h.value_alignment = alignof(T);
+  h.handle_count = indices.size();
+  h.block_count = blocks.size();
+  const auto indices_end =
+      sizeof(h) + indices.size() * sizeof(std::uint64_t);
+  h.values_offset = (indices_end + alignof(T) - 1) / alignof(T) * alignof(T);
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  out.write(reinterpret_cast<const char*>(indices.data()),
+            std::streamsize(indices.size() * sizeof(std::uint64_t)));
+  const char padding[alignof(T)] = {};
+  out.write(padding, std::streamsize(h.values_offset - indices_end));
+  for (auto p : blocks)
+  {
+    out.write(reinterpret_cast<const char*>(p), sizeof(T));
+  }
+  if (!out.flush())
+  {
+    throw std::runtime_error("failed to write copy_on_write image: " + path);
+  }
+}
+
+//
+// Maps an image and exposes its values as copy_on_write handles without
+// copying them. The image holds a reference to every value it loaded, so while
+// it exists the first `mutate` of a handle clones the value to the heap.
+//
+
+template <typename T>
+class cow_image
+{
+  static_assert(std::is_trivially_copyable<T>::value,
+                "image values must be trivially copyable");
+
+  std::vector<copy_on_write<T>> handles_;
+  std::vector<copy_on_write<T>> blocks_;
+
+public:
+  explicit cow_image(const std::string& path)
+  {
+    auto file = std::make_shared<const mapped_file>(path);
+    auto invalid = [&] {
+      return std::runtime_error("invalid copy_on_write image: " + path);
+    };
+
+    cow_image_header h;
+    if (file->size() < sizeof(h))
+    {
+      throw invalid();
+    }
+    std::memcpy(&h, file->data(), sizeof(h));
+    if (std::memcmp(h.magic, cow_image_magic, sizeof(h.magic)) != 0 ||
+        h.value_size != sizeof(T) || h.value_alignment != alignof(T) ||
+        h.values_offset % alignof(T) != 0 ||
+        h.handle_count > (file->size() - sizeof(h)) / sizeof(std::uint64_t) ||
+        h.values_offset > file->size() ||
+        h.block_count > (file->size() - h.values_offset) / sizeof(T))
+    {
+      throw invalid();
+    }
+
+    blocks_.reserve(h.block_count);
+    for (std::uint64_t i = 0; i < h.block_count; ++i)
+    {
+      auto t = reinterpret_cast<T*>(file->data() + h.values_offset +
+                                    i * sizeof(T));
+      copy_on_write<T> c;
+      c.cb_ = std::make_shared<mapped_shared_control_block<T>>(file, t);
+      c.ptr_ = t;
+      blocks_.push_back(std::move(c));
+    }
+
+    const auto empty = std::numeric_limits<std::uint64_t>::max();
+    handles_.reserve(h.handle_count);
+    for (std::uint64_t i = 0; i < h.handle_count; ++i)
+    {
+      std::uint64_t index;
+      std::memcpy(&index, file->data() + sizeof(h) + i * sizeof(index),
+                  sizeof(index));
+      if (index == empty)
+      {
+        handles_.emplace_back();
+      }
+      else if (index < blocks_.size())
+      {
+        handles_.push_back(blocks_[index]);
+      }
+      else
+      {
+        throw invalid();
+      }
+    }
+  }
+
+  const std::vector<copy_on_write<T>>& handles() const
+  {
+    return handles_;
+  }
+
+  std::size_t block_count() const
+  {
+    return blocks_.size();
+  }
+};
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+// `cow_history` class definition
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// An undo/redo history of snapshots with a memory budget. A value shared by
+// several snapshots is counted once, using the size reported by `S`. When a
+// commit takes the history over budget the oldest snapshots are evicted; the
+// current snapshot is always kept.
+//
+
+template <typename T, typename S = payload_size<T>>
+class cow_history
+{
+  struct block_usage
+  {
+    std::size_t references;
+    std::size_t bytes;
+  };
+
+  std::deque<copy_on_write<T>> snapshots_;
+  std::size_t current_ = 0;
+  std::size_t budget_;
+  std::size_t bytes_ = 0;
+  std::unordered_map<const void*, block_usage> blocks_;
+  S size_;
+
+  void account(const copy_on_write<T>& c)
+  {
+    if (!c)
+    {
+      return;
+    }
+    auto inserted = blocks_.emplace(c.identity(), block_usage{0, 0});
+    auto& usage = inserted.first->second;
+    if (inserted.second)
+    {
+      usage.bytes = size_(*c);
+      bytes_ += usage.bytes;
+    }
+    ++usage.references;
+  }
+
+  void unaccount(const copy_on_write<T>& c)
+  {
+    if (!c)
+    {
+      return;
+    }
+    auto it = blocks_.find(c.identity());
+    assert(it != blocks_.end());
+    if (--it->second.references == 0)
+    {
+      bytes_ -= it->second.bytes;
+      blocks_.erase(it);
+    }
+  }
+
+  void evict_over_budget()
+  {
+    while (bytes_ > budget_ && current_ > 0)
+    {
+      unaccount(snapshots_.front());
+      snapshots_.pop_front();
+      --current_;
+    }
+  }
+
+public:
+  explicit cow_history(std::size_t budget, S size = S{})
+      : budget_(budget), size_(std::move(size))
+  {
+  }
+
+  void commit(copy_on_write<T> c)
+  {
+    while (can_redo())
+    {
+      unaccount(snapshots_.back());
+      snapshots_.pop_back();
+    }
+    account(c);
+    snapshots_.push_back(std::move(c));
+    current_ = snapshots_.size() - 1;
+    evict_over_budget();
+  }
+
+  bool can_undo() const
+  {
+    return current_ > 0;
+  }
+
+  bool can_redo() const
+  {
+    return current_ + 1 < snapshots_.size();
+  }
+
+  bool undo()
+  {
+    if (!can_undo())
+    {
+      return false;
+    }
+    --current_;
+    return true;
+  }
+
+  bool redo()
+  {
+    if (!can_redo())
+    {
+      return false;
+    }
+    ++current_;
+    return true;
+  }
+
+  const copy_on_write<T>& current() const
+  {
+    assert(!snapshots_.empty());
+    return snapshots_[current_];
+  }
+
+  std::size_t size() const
+  {
+    return snapshots_.size();
+  }
+
+  bool empty() const
+  {
+    return snapshots_.empty();
+  }
+
+  std::size_t budget() const
+  {
+    return budget_;
+  }
+
+  // Bytes held by the history, counting each distinct value once.
+  std::size_t memory_usage() const
+  {
+    return bytes_;
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory accounting
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Reports the memory held by a set of handles using the size reported by `S`.
+// A value reached through upcast handles is conservatively treated as shared
+// unless all of the examined handles to it have the same static type.
+//
+
+template <typename It, typename S>
+memory_usage_report memory_usage(It first, It last, S size)
+{
+  struct block_references
+  {
+    const void* cb;
+    long use_count;
+    long references;
+    bool owner;
+    bool mixed;
+    std::size_t bytes;
+  };
+
+  memory_usage_report report;
+  std::unordered_map<const void*, block_references> blocks;
+  for (; first != last; ++first)
+  {
+    const auto& c = *first;
+    if (!c)
+    {
+      continue;
+    }
+
+    const auto bytes = size(*c);
+    report.total += bytes;
+    auto inserted = blocks.emplace(
+        c.identity(), block_references{c.cb_.get(), c.cb_.use_count(), 0,
+                                       c.identity() == c.cb_.get(), false,
+                                       bytes});
+    auto& b = inserted.first->second;
+    if (b.cb != c.cb_.get())
+    {
+      b.mixed = true;
+    }
+    ++b.references;
+  }
+
+  for (const auto& b : blocks)
+  {
+    report.deduplicated += b.second.bytes;
+    if (b.second.owner && !b.second.mixed &&
+        b.second.references == b.second.use_count)
+    {
+      report.exclusive += b.second.bytes;
+    }
+  }
+  return report;
+}
+
+template <typename It>
+memory_usage_report memory_usage(It first, It last)
+{
+  using T = std::decay_t<decltype(**first)>;
+  return memory_usage(first, last, payload_size<T>{});
+}
+
+template <typename Range>
+memory_usage_report memory_usage(const Range& r)
+{
+  using std::begin;
+  using std::end;
+  return memory_usage(begin(r), end(r));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Structural diff and patch
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// `diff(a, b)` describes how to turn `a` into `b`. Values that share a control
+// block are unchanged and are skipped without being compared. Maps of
+// copy_on_write values are diffed key by key, recursing into changed
+// entries; any other value is replaced as a whole. `apply_patch` shares every
+// part of the target that the patch does not touch. A target that has diverged
+// from the patch's base so that an entry to be updated is missing is left
+// unchanged and std::invalid_argument is thrown.
+//
+
+template <typename T>
+struct cow_patch
+{
+  bool changed = false;
+  copy_on_write<T> value;
+};
+
+template <typename K, typename V, typename Compare, typename Alloc>
+struct cow_patch<std::map<K, copy_on_write<V>, Compare, Alloc>>
+{
+  using map_type = std::map<K, copy_on_write<V>, Compare, Alloc>;
+
+  bool changed = false;
+  // Set when the map is replaced as a whole, i.e. when either side is empty.
+  bool replaced = false;
+  copy_on_write<map_type> value;
+  std::vector<std::pair<K, copy_on_write<V>>> inserted;
+  std::vector<std::pair<K, cow_patch<V>>> updated;
+  std::vector<K> erased;
+};
+
+template <typename T>
+struct cow_differ
+{
+  static cow_patch<T> diff(const copy_on_write<T>& a,
+                           const copy_on_write<T>& b)
+  {
+    cow_patch<T> p;
+    if (a.identity() != b.identity())
+    {
+      p.changed = true;
+      p.value = copy_on_write<T>(b);
+    }
+    return p;
+  }
+
+  static bool applies_to(const copy_on_write<T>&, const cow_patch<T>&)
+  {
+    return true;
+  }
+
+  static void apply(copy_on_write<T>& c, const cow_patch<T>& p)
+  {
+    if (p.changed)
+    {
+      // Move-assign a copy so that the patched value is shared, not cloned.
+      c = copy_on_write<T>(p.value);
+    }
+  }
+};
+
+template <typename T>
+cow_patch<T> diff(const copy_on_write<T>& a, const copy_on_write<T>& b)
+{
+  return cow_differ<T>::diff(a, b);
+}
+
+template <typename T>
+void apply_patch(copy_on_write<T>& c, const cow_patch<T>& p)
+{
+  if (!cow_differ<T>::applies_to(c, p))
+  {
+    throw std::invalid_argument(
+        "apply_patch: the target does not match the base of the patch");
+  }
+  cow_differ<T>::apply(c, p);
+}
+
+template <typename K, typename V, typename Compare, typename Alloc>
+struct cow_differ<std::map<K, copy_on_write<V>, Compare, Alloc>>
+{
+  using map_type = std::map<K, copy_on_write<V>, Compare, Alloc>;
+
+  static cow_patch<map_type> diff(const copy_on_write<map_type>& a,
+                                  const copy_on_write<map_type>& b)
+  {
+    cow_patch<map_type> p;
+    if (a.identity() == b.identity())
+    {
+      return p;
+    }
+
+    p.changed = true;
+    if (!a || !b)
+    {
+      p.replaced = true;
+      p.value = copy_on_write<map_type>(b);
+      return p;
+    }
+
+    const auto less = a->key_comp();
+    auto i = a->begin();
+    auto j = b->begin();
+    while (i != a->end() || j != b->end())
+    {
+      if (j == b->end() || (i != a->end() && less(i->first, j->first)))
+      {
+        p.erased.push_back(i->first);
+        ++i;
+      }
+      else if (i == a->end() || less(j->first, i->first))
+      {
+        p.inserted.emplace_back(j->first, j->second);
+        ++j;
+      }
+      else
+      {
+        if (i->second.identity() != j->second.identity())
+        {
+          p.updated.emplace_back(
+              i->first, cow_differ<V>::diff(i->second, j->second));
+        }
+        ++i;
+        ++j;
+      }
+    }
+    return p;
+  }
+
+  // Checked before anything is changed, so that a mismatch leaves the target
+  // as it was.
+  static bool applies_to(const copy_on_write<map_type>& c,
+                         const cow_patch<map_type>& p)
+  {
+    if (!p.changed || p.replaced)
+    {
+      return true;
+    }
+    if (!c)
+    {
+      return false;
+    }
+    for (const auto& u : p.updated)
+    {
+      auto it = c->find(u.first);
+      if (it == c->end() || !cow_differ<V>::applies_to(it->second, u.second))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static void apply(copy_on_write<map_type>& c, const cow_patch<map_type>& p)
+  {
+    if (!p.changed)
+    {
+      return;
+    }
+    if (p.replaced)
+    {
+      c = copy_on_write<map_type>(p.value);
+      return;
+    }
+
+    auto m = mutate(c);
+    for (const auto& k : p.erased)
+    {
+      m->erase(k);
+    }
+    for (const auto& u : p.updated)
+    {
+      cow_differ<V>::apply(m->find(u.first)->second, u.second);
+    }
+    for (const auto& e : p.inserted)
+    {
+      auto it = m->find(e.first);
+      if (it == m->end())
+      {
+        m->emplace(e.first, e.second);
+      }
+      else
+      {
+        it->second = copy_on_write<V>(e.second);
+      }
+    }
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Asynchronous mutation
+////////////////////////////////////////////////////////////////////////////////
+
+// Runs each task on a new detached thread.
+struct thread_executor
+{
+  void operator()(std::function<void()> f) const
+  {
+    std::thread(std::move(f)).detach();
+  }
+};
+
+//
+// Tracks detaches in flight by control block. A request made when every
+// other handle to its block is already being detached waits for them rather
+// than cloning, since once they are done its handle will be unique.
+//
+
+class detach_registry
+{
+  struct block_state
+  {
+    std::size_t in_flight = 0;
+    std::vector<std::function<void()>> waiting;
+  };
+
+  std::mutex mutex_;
+  std::unordered_map<const void*, block_state> blocks_;
+
+public:
+  // Never destroyed, so that executor threads still running at program exit
+  // can complete their requests.
+  static detach_registry& instance()
+  {
+    static auto r = new detach_registry;
+    return *r;
+  }
+
+  // Returns true if a request to detach from `block`, which has `use_count`
+  // handles, should start now. Otherwise `resume` is run once the requests in
+  // flight have completed.
+  bool enqueue(const void* block, long use_count, std::function<void()> resume)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& state = blocks_[block];
+    const auto others = state.in_flight + state.waiting.size();
+    if (state.in_flight > 0 && use_count <= long(others) + 1)
+    {
+      state.waiting.push_back(std::move(resume));
+      return false;
+    }
+    ++state.in_flight;
+    return true;
+  }
+
+  void complete(const void* block)
+  {
+    std::vector<std::function<void()>> resumed;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = blocks_.find(block);
+      assert(it != blocks_.end() && it->second.in_flight > 0);
+      if (--it->second.in_flight == 0)
+      {
+        resumed = std::move(it->second.waiting);
+        blocks_.erase(it);
+      }
+    }
+    for (auto& f : resumed)
+    {
+      f();
+    }
+  }
+};
+
+//
+// Runs `mutate(c)` on `executor` and returns a future for the resulting
+// pointer. `c` must not be used until the future is ready. If `c` does not
+// need to detach the future is ready immediately. Requests for handles
+// sharing a value clone in parallel, except that the last remaining handle
+// takes the value without a clone once the others have detached.
+//
+
+template <typename T, typename Executor>
+std::future<T*> async_mutate(copy_on_write<T>& c, Executor executor)
+{
+  auto result = std::make_shared<std::promise<T*>>();
+  auto future = result->get_future();
+  if (!c || c.unique())
+  {
+    result->set_value(mutate(c));
+    return future;
+  }
+
+  std::function<void()> run = [&c, result] {
+    try
+    {
+      result->set_value(mutate(c));
+    }
+    catch (...)
+    {
+      result->set_exception(std::current_exception());
+    }
+  };
+
+  const auto block = c.identity();
+  auto& registry = detach_registry::instance();
+  if (registry.enqueue(block, c.use_count(), run))
+  {
+    try
+    {
+      executor([run, block, &registry] {
+        run();
+        registry.complete(block);
+      });
+    }
+    catch (...)
+    {
+      // The request never started, so it must not hold up later ones.
+      result->set_exception(std::current_exception());
+      registry.complete(block);
+    }
+  }
+  return future;
+}
+
+template <typename T>
+std::future<T*> async_mutate(copy_on_write<T>& c)
+{
+  return async_mutate(c, thread_executor{});
+}
+
+//
+// Hints that `c` is about to be mutated while shared: its value is cloned on
+// `executor` so that a later `mutate` only has to install the clone. A clone
+// that is not ready when `mutate` needs it is ignored. A clone that is no
+// longer needed is dropped when it is made if `c` has become unique, when the
+// value is next mutated in place, or when the value is released.
+//
+
+template <typename T, typename Executor>
+void prepare_mutate(const copy_on_write<T>& c, Executor executor)
+{
+  if (!c || c.unique())
+  {
+    return;
+  }
+
+  auto promise = std::make_shared<std::promise<std::shared_ptr<void>>>();
+  auto& speculative = speculative_clone_table::instance();
+  if (!speculative.insert(c.cb_, promise->get_future().share()))
+  {
+    return;
+  }
+
+  // Holding a reference keeps the value shared, and so unmodified, while it
+  // is cloned.
+  auto cb = c.cb_;
+  executor([cb, promise, &speculative]() mutable {
+    try
+    {
+      promise->set_value(cb->clone());
+    }
+    catch (...)
+    {
+      promise->set_exception(std::current_exception());
+    }
+    promise.reset();
+
+    if (cb.use_count() <= 2)
+    {
+      speculative.erase(cb);
+    }
+    // Release the value now in case the executor keeps the task alive.
+    cb.reset();
+  });
+}
+
+template <typename T>
+void prepare_mutate(const copy_on_write<T>& c)
+{
+  prepare_mutate(c, thread_executor{});
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Algorithms over ranges of copy_on_write
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// A range of copy_on_write is a range of pointers to separate heap blocks.
+// These algorithms prefetch the blocks `distance` elements ahead of the one
+// being processed so that the memory accesses overlap. Empty handles are
+// skipped.
+//
+
+constexpr std::size_t default_prefetch_distance = 8;
+
+template <typename It, typename F>
+F for_each_value(It first, It last, F f,
+                 std::size_t distance = default_prefetch_distance)
+{
+  auto ahead = first;
+  for (std::size_t i = 0; i < distance && ahead != last; ++i, ++ahead)
+  {
+    prefetch(*ahead);
+  }
+
+  for (; first != last; ++first)
+  {
+    if (ahead != last)
+    {
+      prefetch(*ahead);
+      ++ahead;
+    }
+    if (*first)
+    {
+      f(**first);
+    }
+  }
+  return f;
+}
+
+template <typename Range, typename F>
+F for_each_value(const Range& r, F f,
+                 std::size_t distance = default_prefetch_distance)
+{
+  using std::begin;
+  using std::end;
+  return for_each_value(begin(r), end(r), std::move(f), distance);
+}
+
+//
+// Calls `f` with a mutable reference to each value. Elements are processed in
+// batches of `distance`: the uniqueness checks (and any detaches) for a whole
+// batch are done before `f` is applied, while the next batch is prefetched.
+//
+
+template <typename It, typename F>
+F transform_mutate(It first, It last, F f,
+                   std::size_t distance = default_prefetch_distance)
+{
+  constexpr std::size_t max_batch = 64;
+  using pointer = decltype(mutate(*first));
+
+  if (distance == 0)
+  {
+    distance = 1;
+  }
+  if (distance > max_batch)
+  {
+    distance = max_batch;
+  }
+
+  pointer batch[max_batch];
+  auto ahead = first;
+  for (std::size_t i = 0; i < distance && ahead != last; ++i, ++ahead)
+  {
+    prefetch(*ahead);
+  }
+
+  while (first != last)
+  {
+    std::size_t n = 0;
+    for (; n < distance && first != last; ++n, ++first)
+    {
+      batch[n] = mutate(*first);
+      if (ahead != last)
+      {
+        prefetch(*ahead);
+        ++ahead;
+      }
+    }
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+      if (batch[i])
+      {
+        f(*batch[i]);
+      }
+    }
+  }
+  return f;
+}
+
+template <typename Range, typename F>
+F transform_mutate(Range& r, F f,
+                   std::size_t distance = default_prefetch_distance)
+{
+  using std::begin;
+  using std::end;
+  return transform_mutate(begin(r), end(r), std::move(f), distance);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// `weak_copy_on_write` class definition
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Observes the value of a copy_on_write without keeping it alive. A weak
+// handle is not counted by `unique`, so it never causes `mutate` to detach.
+// A value that has since been mutated in place through its last handle can
+// no longer be locked, so a weak handle only ever yields the value it
+// observed.
+//
+
+template <typename T>
+class weak_copy_on_write
+{
+  using block = shared_control_block<T>;
+
+  T* ptr_ = nullptr;
+  std::weak_ptr<block> cb_;
+  std::uint64_t stamp_ = 0;
+
+  static std::uint64_t observe(const copy_on_write<T>& c)
+  {
+    if (!c.cb_)
+    {
+      return 0;
+    }
+    return c.cb_->stamp_.fetch_or(block::weakly_observed) |
+           block::weakly_observed;
+  }
+
+public:
+  weak_copy_on_write()
+  {
+  }
+
+  weak_copy_on_write(const copy_on_write<T>& c)
+      : ptr_(c.ptr_), cb_(c.cb_), stamp_(observe(c))
+  {
+  }
+
+  weak_copy_on_write& operator=(const copy_on_write<T>& c)
+  {
+    ptr_ = c.ptr_;
+    cb_ = c.cb_;
+    stamp_ = observe(c);
+    return *this;
+  }
+
+  void reset()
+  {
+    ptr_ = nullptr;
+    cb_.reset();
+    stamp_ = 0;
+  }
+
+  void swap(weak_copy_on_write& w) noexcept
+  {
+    using std::swap;
+    swap(ptr_, w.ptr_);
+    swap(cb_, w.cb_);
+    swap(stamp_, w.stamp_);
+  }
+
+  // Whether the value has been released. A value that has been mutated in
+  // place is not expired, but cannot be locked.
+  bool expired() const
+  {
+    return cb_.expired();
+  }
+
+  // An owning handle to the observed value, or an empty handle if it has been
+  // released or mutated in place.
+  copy_on_write<T> lock() const
+  {
+    copy_on_write<T> c;
+    c.cb_ = cb_.lock();
+    if (c.cb_)
+    {
+      // Pairs with the fence in `mutate`.
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (c.cb_->stamp_.load(std::memory_order_relaxed) != stamp_)
+      {
+        c.cb_.reset();
+        return c;
+      }
+      c.ptr_ = ptr_;
+    }
+    return c;
+  }
+
+  friend void swap(weak_copy_on_write& t, weak_copy_on_write& u) noexcept
+  {
+    t.swap(u);
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// `biased_copy_on_write` class definition
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// Biased reference counting. A count is owned by the thread that created it:
+// handles copied and released on that thread are counted non-atomically, and
+// those on other threads atomically. When the owning thread's count reaches
+// zero, or another thread's release takes the atomic count below zero, the
+// two are merged and the atomic count is used from then on. Another thread
+// cannot touch the owner's count, so it hands the merge to the owner through
+// a queue that the owner drains on its next biased operation or when it
+// exits.
+//
+
+class biased_owner;
+
+struct biased_count_base
+{
+  const std::shared_ptr<biased_owner> owner_;
+  // Only accessed by the owning thread, or after it has exited.
+  std::size_t local_ = 1;
+  bool merged_ = false;
+  // Twice the number of handles counted by other threads, which may be
+  // negative before merging; bit 0 is set once the counts are merged.
+  std::atomic<long> remote_{0};
+  std::atomic<bool> queued_{false};
+  biased_count_base* next_queued_ = nullptr;
+
+  biased_count_base();
+  virtual ~biased_count_base() = default;
+
+  bool owned() const;
+  void drain_pending() const;
+  void merge_if_owner_exited();
+
+  // The caller holds a reference, so merging never releases the last one.
+  void merge()
+  {
+    if (!merged_)
+    {
+      merged_ = true;
+      remote_.fetch_add(long(2 * local_ + 1), std::memory_order_acq_rel);
+      local_ = 0;
+    }
+  }
+
+  void acquire()
+  {
+    if (owned())
+    {
+      drain_pending();
+      if (!merged_)
+      {
+        ++local_;
+        return;
+      }
+    }
+    remote_.fetch_add(2, std::memory_order_relaxed);
+  }
+
+  // Returns true if this was the last handle.
+  bool release()
+  {
+    if (owned())
+    {
+      drain_pending();
+      if (!merged_)
+      {
+        if (--local_ != 0)
+        {
+          return false;
+        }
+        merged_ = true;
+        return remote_.fetch_add(1, std::memory_order_acq_rel) == 0;
+      }
+    }
+    return release_remote();
+  }
+
+  bool release_remote();
+
+  // Whether the calling handle is the only one. Before merging only the
+  // owning thread can tell.
+  bool sole()
+  {
+    const bool owner = owned();
+    if (owner)
+    {
+      drain_pending();
+    }
+    else
+    {
+      merge_if_owner_exited();
+    }
+    const auto remote = remote_.load(std::memory_order_acquire);
+    if (remote & 1)
+    {
+      return remote == 3;
+    }
+    return owner && long(local_) + remote / 2 == 1;
+  }
+};
+
+class biased_owner
+{
+  std::atomic<biased_count_base*> queue_{nullptr};
+
+  static biased_count_base* closed()
+  {
+    return reinterpret_cast<biased_count_base*>(std::uintptr_t(1));
+  }
+
+  // Each queued count carries a reference handed over by the thread that
+  // queued it.
+  static void process(biased_count_base* c)
+  {
+    while (c)
+    {
+      auto next = c->next_queued_;
+      c->queued_.store(false);
+      c->merge();
+      if (c->release_remote())
+      {
+        delete c;
+      }
+      c = next;
+    }
+  }
+
+  struct holder
+  {
+    std::shared_ptr<biased_owner> owner_ = std::make_shared<biased_owner>();
+
+    ~holder()
+    {
+      owner_->process(owner_->queue_.exchange(closed()));
+    }
+  };
+
+public:
+  static const std::shared_ptr<biased_owner>& current()
+  {
+    static thread_local holder h;
+    return h.owner_;
+  }
+
+  bool pending() const
+  {
+    return queue_.load(std::memory_order_relaxed) != nullptr;
+  }
+
+  bool exited() const
+  {
+    return queue_.load(std::memory_order_acquire) == closed();
+  }
+
+  void drain()
+  {
+    process(queue_.exchange(nullptr, std::memory_order_acquire));
+  }
+
+  // Queues a merge of `c` for the owning thread. Returns false if the owner
+  // has exited.
+  bool push(biased_count_base* c)
+  {
+    auto head = queue_.load(std::memory_order_acquire);
+    do
+    {
+      if (head == closed())
+      {
+        return false;
+      }
+      c->next_queued_ = head;
+    } while (!queue_.compare_exchange_weak(head, c, std::memory_order_release,
+                                           std::memory_order_acquire));
+    return true;
+  }
+};
+
+inline biased_count_base::biased_count_base()
+    : owner_(biased_owner::current())
+{
+}
+
+inline bool biased_count_base::owned() const
+{
+  return owner_ == biased_owner::current();
+}
+
+inline void biased_count_base::drain_pending() const
+{
+  if (owner_->pending())
+  {
+    owner_->drain();
+  }
+}
+
+// Once the owner has exited its count no longer changes, so any thread may
+// merge it; `queued_` keeps two threads from doing so at once.
+inline void biased_count_base::merge_if_owner_exited()
+{
+  if (!(remote_.load(std::memory_order_acquire) & 1) && owner_->exited() &&
+      !queued_.exchange(true))
+  {
+    merge();
+    queued_.store(false);
+  }
+}
+
+inline bool biased_count_base::release_remote()
+{
+  auto remote = remote_.load(std::memory_order_relaxed);
+  for (;;)
+  {
+    // Releasing would take the atomic count below zero, so the handles left
+    // may all be counted by the owner: hand this reference to the owner to
+    // merge, or merge here if the owner has exited.
+    if (!(remote & 1) && remote < 2 && !queued_.exchange(true))
+    {
+      if (owner_->push(this))
+      {
+        return false;
+      }
+      merge();
+      queued_.store(false);
+      remote = remote_.load(std::memory_order_relaxed);
+    }
+    if (remote_.compare_exchange_weak(remote, remote - 2,
+                                      std::memory_order_acq_rel,
+                                      std::memory_order_relaxed))
+    {
+      return remote == 3;
+    }
+  }
+}
+
+template <typename T>
+struct biased_count : biased_count_base
+{
+  copy_on_write<T> shared_;
+
+  explicit biased_count(copy_on_write<T> c) : shared_(std::move(c))
+  {
+  }
+};
+
+//
+// A handle biased towards the thread that created it. Biased handles to a
+// value share one reference to its control block and count themselves with
+// a biased count, so copies made and released on the creating thread never
+// touch an atomic. Handles may be copied, moved and released on any thread.
+//
+
+template <typename T>
+class biased_copy_on_write
+{
+  biased_count<T>* count_ = nullptr;
+
+  void release()
+  {
+    if (count_ && count_->release())
+    {
+      delete count_;
+    }
+    count_ = nullptr;
+  }
+
+public:
+
+  //
+  // Destructor
+  //
+
+  ~biased_copy_on_write()
+  {
+    release();
+  }
+
+  //
+  // Constructors
+  //
+
+  biased_copy_on_write()
+  {
+  }
+
+  explicit biased_copy_on_write(copy_on_write<T> c)
+  {
+    if (c)
+    {
+      count_ = new biased_count<T>(std::move(c));
+    }
+  }
+
+  biased_copy_on_write(const biased_copy_on_write& b) : count_(b.count_)
+  {
+    if (count_)
+    {
+      count_->acquire();
+    }
+  }
+
+  biased_copy_on_write(biased_copy_on_write&& b) : count_(b.count_)
+  {
+    b.count_ = nullptr;
+  }
+
+  //
+  // Assignment
+  //
+
+  biased_copy_on_write& operator=(const biased_copy_on_write& b)
+  {
+    biased_copy_on_write tmp(b);
+    swap(tmp);
+    return *this;
+  }
+
+  biased_copy_on_write& operator=(biased_copy_on_write&& b) noexcept
+  {
+    if (&b == this)
+    {
+      return *this;
+    }
+
+    release();
+    count_ = b.count_;
+    b.count_ = nullptr;
+    return *this;
+  }
+
+  //
+  // Modifiers
+  //
+
+  void swap(biased_copy_on_write& b) noexcept
+  {
+    using std::swap;
+    swap(count_, b.count_);
+  }
+
+  //
+  // Observers
+  //
+
+  explicit operator bool() const
+  {
+    return count_ != nullptr;
   }
 
+  // May report false for a unique handle on a thread other than its owner
+  // until the owning thread has released its handles or exited.
   bool unique() const
   {
-    return cb_.unique();
+    return count_ && count_->sole() && count_->shared_.unique();
+  }
+
+  std::uint64_t version() const
+  {
+    return count_ ? count_->shared_.version() : 0;
   }
 
   const T& operator*() const
   {
-    assert(ptr_);
-    return *ptr_;
+    assert(count_);
+    return *count_->shared_;
   }
 
   const T* operator->() const
   {
-    assert(ptr_);
-    return ptr_;
+    assert(count_);
+    return count_->shared_.operator->();
   }
-  
+
   const T& value() const
   {
-    return *ptr_;
+    return count_->shared_.value();
+  }
+
+  // An ordinary handle to the same value.
+  copy_on_write<T> share() const
+  {
+    return count_ ? count_->shared_ : copy_on_write<T>();
   }
 
   //
   // Mutator
   //
 
-  friend T* mutate(copy_on_write& c)
+  friend T* mutate(biased_copy_on_write& b)
   {
-    if ( c.ptr_ && ! c.cb_.unique() )
+    if (!b.count_)
     {
-      c.detach();
+      return nullptr;
     }
-    return c.ptr_;
+
+    if (!b.count_->sole())
+    {
+      // Leave for a new count owned by this thread; its reference to the
+      // shared control block makes it non-unique so `mutate` below will
+      // detach.
+      biased_copy_on_write tmp(b.count_->shared_);
+      b.swap(tmp);
+    }
+    return mutate(b.count_->shared_);
   }
 
   //
   // non-member swap
   //
 
-  friend void swap(copy_on_write& t, copy_on_write& u) noexcept
+  friend void swap(biased_copy_on_write& t, biased_copy_on_write& u) noexcept
   {
     t.swap(u);
   }
 };
 
+////////////////////////////////////////////////////////////////////////////////
+// Epoch-based reclamation
+////////////////////////////////////////////////////////////////////////////////
+
 //
-// copy_on_write creation
+// Readers announce the global epoch they entered in a per-thread slot. Retired
+// control blocks are tagged with the epoch in which they were unlinked and are
+// released once every active reader has entered a later epoch.
 //
 
-template <typename T, typename... Ts>
-copy_on_write<T> make_copy_on_write(Ts&&... ts)
+class epoch_domain
 {
-  copy_on_write<T> p;
-  p.cb_ = std::make_unique<direct_shared_control_block<T>>(std::forward<Ts>(ts)...);
-  p.ptr_ = p.cb_->ptr();
-  return std::move(p);
-}
+  // Slots form a list that only grows; a slot released by an exiting thread
+  // is reused by the next thread to register. C++14 allocation does not
+  // honour over-alignment, so padding keeps each slot's epoch off the cache
+  // lines of its neighbours instead.
+  struct reader_slot
+  {
+    char leading_padding_[cache_line_size];
+    std::atomic<std::uint64_t> epoch_{0};
+    std::atomic<bool> in_use_{true};
+    reader_slot* next_ = nullptr;
+    char trailing_padding_[cache_line_size];
+  };
+
+  struct reader_registration
+  {
+    reader_slot* slot_;
+    std::size_t depth_ = 0;
+
+    explicit reader_registration(epoch_domain& d) : slot_(d.claim_slot())
+    {
+    }
+
+    ~reader_registration()
+    {
+      slot_->in_use_.store(false);
+    }
+  };
+
+  std::atomic<std::uint64_t> epoch_{1};
+  std::atomic<reader_slot*> slots_{nullptr};
+  std::mutex retired_mutex_;
+  std::vector<std::pair<std::uint64_t, std::shared_ptr<void>>> retired_;
+
+  epoch_domain() = default;
+
+  reader_slot* claim_slot()
+  {
+    for (auto slot = slots_.load(); slot; slot = slot->next_)
+    {
+      bool expected = false;
+      if (slot->in_use_.compare_exchange_strong(expected, true))
+      {
+        return slot;
+      }
+    }
+
+    auto slot = new reader_slot;
+    slot->next_ = slots_.load();
+    while (!slots_.compare_exchange_weak(slot->next_, slot))
+    {
+    }
+    return slot;
+  }
+
+  // There is a single domain, so each thread registers with it once.
+  reader_registration& registration()
+  {
+    static thread_local reader_registration r(*this);
+    return r;
+  }
+
+  std::uint64_t oldest_active_epoch() const
+  {
+    auto oldest = epoch_.load();
+    for (auto slot = slots_.load(); slot; slot = slot->next_)
+    {
+      auto e = slot->epoch_.load();
+      if (e != 0 && e < oldest)
+      {
+        oldest = e;
+      }
+    }
+    return oldest;
+  }
+
+public:
+  epoch_domain(const epoch_domain&) = delete;
+  epoch_domain& operator=(const epoch_domain&) = delete;
+
+  // Never destroyed, so that threads still reading at program exit can
+  // release their slots.
+  static epoch_domain& instance()
+  {
+    static auto d = new epoch_domain;
+    return *d;
+  }
+
+  void enter()
+  {
+    auto& r = registration();
+    if (r.depth_++ == 0)
+    {
+      r.slot_->epoch_.store(epoch_.load());
+    }
+  }
+
+  void leave()
+  {
+    auto& r = registration();
+    assert(r.depth_ > 0);
+    if (--r.depth_ == 0)
+    {
+      r.slot_->epoch_.store(0);
+    }
+  }
+
+  // `p` must already be unreachable for readers that enter after this call.
+  void retire(std::shared_ptr<void> p)
+  {
+    auto e = epoch_.fetch_add(1);
+    {
+      std::lock_guard<std::mutex> lock(retired_mutex_);
+      retired_.emplace_back(e, std::move(p));
+    }
+    reclaim();
+  }
+
+  void reclaim()
+  {
+    std::vector<std::pair<std::uint64_t, std::shared_ptr<void>>> released;
+    {
+      std::lock_guard<std::mutex> lock(retired_mutex_);
+      auto oldest = oldest_active_epoch();
+      auto it = retired_.begin();
+      while (it != retired_.end())
+      {
+        if (it->first < oldest)
+        {
+          released.push_back(std::move(*it));
+          *it = std::move(retired_.back());
+          retired_.pop_back();
+        }
+        else
+        {
+          ++it;
+        }
+      }
+    }
+    // `released` is destroyed outside the lock.
+  }
+
+  std::size_t retired_count()
+  {
+    std::lock_guard<std::mutex> lock(retired_mutex_);
+    return retired_.size();
+  }
+};
+
+class epoch_guard
+{
+  bool active_ = true;
+
+public:
+  epoch_guard()
+  {
+    epoch_domain::instance().enter();
+  }
+
+  epoch_guard(const epoch_guard&) = delete;
+  epoch_guard& operator=(const epoch_guard&) = delete;
+
+  epoch_guard(epoch_guard&& g) : active_(g.active_)
+  {
+    g.active_ = false;
+  }
+
+  ~epoch_guard()
+  {
+    if (active_)
+    {
+      epoch_domain::instance().leave();
+    }
+  }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// `epoch_copy_on_write` class definition
+////////////////////////////////////////////////////////////////////////////////
+
+//
+// A shared cell holding a copy_on_write value. Readers borrow the current
+// value without touching the reference count; writers always detach, publish
+// the new value and retire the old control block to the epoch domain.
+//
+
+template <typename T>
+class epoch_copy_on_write
+{
+  mutable std::mutex writer_mutex_;
+  copy_on_write<T> value_;
+  std::atomic<const T*> current_{nullptr};
+
+  void publish(copy_on_write<T> c)
+  {
+    std::swap(value_, c);
+    current_.store(value_.ptr_);
+    if (c.cb_)
+    {
+      epoch_domain::instance().retire(std::move(c.cb_));
+    }
+  }
+
+public:
+  class snapshot
+  {
+    epoch_guard guard_;
+    const T* p_ = nullptr;
+
+    friend class epoch_copy_on_write;
+
+    explicit snapshot(const std::atomic<const T*>& p) : p_(p.load())
+    {
+    }
+
+  public:
+    explicit operator bool() const
+    {
+      return bool(p_);
+    }
+
+    const T& operator*() const
+    {
+      assert(p_);
+      return *p_;
+    }
+
+    const T* operator->() const
+    {
+      assert(p_);
+      return p_;
+    }
+  };
+
+  epoch_copy_on_write()
+  {
+  }
+
+  explicit epoch_copy_on_write(copy_on_write<T> c)
+  {
+    publish(std::move(c));
+  }
+
+  epoch_copy_on_write(const epoch_copy_on_write&) = delete;
+  epoch_copy_on_write& operator=(const epoch_copy_on_write&) = delete;
+
+  // Borrow the current value. The referenced value stays alive until the
+  // snapshot is destroyed.
+  snapshot read() const
+  {
+    return snapshot(current_);
+  }
+
+  copy_on_write<T> load() const
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    return value_;
+  }
 
+  void store(copy_on_write<T> c)
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    publish(std::move(c));
+  }
+
+  // Apply `f` to a private copy of the current value and publish it.
+  template <typename F>
+  void update(F f)
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    auto c = value_;
+    if (auto p = mutate(c))
+    {
+      f(*p);
+    }
+    publish(std::move(c));
+  }
+};
@@ -0,0 +1,297 @@
+#include "copy_on_write.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <thread>
+#include <vector>
+
+//
+// Scenario benchmarks modelling production use of copy_on_write. Each scenario
+// reports allocations per operation, counted by the replacement operator new
+// below, and p50/p99/p999 latencies of individual operations.
+//
+
+namespace
+{
+
+std::atomic<std::size_t> allocation_count{0};
+
+void* counted_allocate(std::size_t size)
+{
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1))
+  {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+} // namespace
+
+void* operator new(std::size_t size)
+{
+  return counted_allocate(size);
+}
+
+void* operator new[](std::size_t size)
+{
+  return counted_allocate(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  try
+  {
+    return counted_allocate(size);
+  }
+  catch (...)
+  {
+    return nullptr;
+  }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  return operator new(size, std::nothrow);
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+  std::free(p);
+}
+
+namespace
+{
+
+using clock_type = std::chrono::steady_clock;
+
+class scenario_report
+{
+  std::vector<std::uint64_t> samples_;
+  std::size_t allocations_ = 0;
+
+public:
+  // Reserving up front keeps the report's own allocations out of the counts.
+  void reserve(std::size_t n)
+  {
+    samples_.reserve(n);
+  }
+
+  void record(clock_type::duration d)
+  {
+    samples_.push_back(std::uint64_t(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+  }
+
+  void merge(scenario_report& r)
+  {
+    samples_.insert(samples_.end(), r.samples_.begin(), r.samples_.end());
+  }
+
+  void add_allocations(std::size_t n)
+  {
+    allocations_ += n;
+  }
+
+  void print(const char* name)
+  {
+    if (samples_.empty())
+    {
+      return;
+    }
+    std::sort(samples_.begin(), samples_.end());
+    auto percentile = [&](double p) {
+      auto i = std::size_t(p * double(samples_.size() - 1));
+      return (unsigned long long)samples_[i];
+    };
+    std::printf("%-28s %9zu %10.2f %8llu %8llu %8llu\n", name,
+                samples_.size(), double(allocations_) / samples_.size(),
+                percentile(0.5), percentile(0.99), percentile(0.999));
+  }
+};
+
+template <typename F>
+void timed(scenario_report& r, F f)
+{
+  auto start = clock_type::now();
+  f();
+  r.record(clock_type::now() - start);
+}
+
+const std::size_t operations = 100000;
+
+template <typename F>
+void run(const char* name, F f)
+{
+  scenario_report r;
+  r.reserve(operations);
+  const auto before = allocation_count.load();
+  f(r);
+  r.add_allocations(allocation_count.load() - before);
+  r.print(name);
+}
+
+//
+// Take a snapshot of some state, then change the live copy: each operation
+// detaches a 1000-element vector.
+//
+
+void snapshot_then_mutate(scenario_report& r)
+{
+  auto state = make_copy_on_write<std::vector<int>>(1000, 0);
+  copy_on_write<std::vector<int>> snapshot;
+  for (std::size_t i = 0; i < operations; ++i)
+  {
+    timed(r, [&] {
+      snapshot = copy_on_write<std::vector<int>>(state);
+      (*mutate(state))[i % 1000] += 1;
+    });
+  }
+}
+
+//
+// Many threads copying and reading one shared value.
+//
+
+void fan_out_reads(scenario_report& r)
+{
+  const auto shared = make_copy_on_write<std::vector<int>>(64, 1);
+  const unsigned threads = std::max(2u, std::thread::hardware_concurrency());
+  std::vector<scenario_report> reports(threads);
+  std::vector<std::thread> workers;
+  for (unsigned t = 0; t < threads; ++t)
+  {
+    workers.emplace_back([&, t] {
+      auto& tr = reports[t];
+      long sum = 0;
+      for (std::size_t i = 0; i < operations / threads; ++i)
+      {
+        timed(tr, [&] {
+          copy_on_write<std::vector<int>> local(shared);
+          sum += (*local)[i % 64];
+        });
+      }
+      if (sum < 0)
+      {
+        std::printf("%ld\n", sum);
+      }
+    });
+  }
+  for (auto& w : workers)
+  {
+    w.join();
+  }
+  for (auto& tr : reports)
+  {
+    r.merge(tr);
+  }
+}
+
+//
+// A pipeline of stages that take and return values through copy_on_write to
+// a base class, as in test_copy_on_write.cpp.
+//
+
+struct BaseType
+{
+  virtual int value() const = 0;
+  virtual void set_value(int) = 0;
+  virtual ~BaseType() = default;
+};
+
+struct DerivedType : BaseType
+{
+  int value_ = 0;
+
+  DerivedType(int v) : value_(v)
+  {
+  }
+
+  int value() const override
+  {
+    return value_;
+  }
+
+  void set_value(int i) override
+  {
+    value_ = i;
+  }
+};
+
+copy_on_write<BaseType> increment_stage(copy_on_write<BaseType> c)
+{
+  auto p = mutate(c);
+  p->set_value(p->value() + 1);
+  return c;
+}
+
+void upcast_pipeline(scenario_report& r)
+{
+  long sum = 0;
+  for (std::size_t i = 0; i < operations; ++i)
+  {
+    timed(r, [&] {
+      copy_on_write<BaseType> c = make_copy_on_write<DerivedType>(int(i));
+      auto kept = c;
+      c = increment_stage(std::move(c));
+      c = increment_stage(std::move(c));
+      sum += c->value() - kept->value();
+    });
+  }
+  if (sum != long(2 * operations))
+  {
+    std::printf("unexpected checksum %ld\n", sum);
+  }
+}
+
+//
+// Creating, copying and dropping many small values.
+//
+
+void small_value_churn(scenario_report& r)
+{
+  std::vector<copy_on_write<int>> live(1024);
+  for (std::size_t i = 0; i < operations; ++i)
+  {
+    timed(r, [&] {
+      auto& slot = live[i % live.size()];
+      slot = make_copy_on_write<int>(int(i));
+      auto copy = copy_on_write<int>(live[(i * 7) % live.size()]);
+      if (copy)
+      {
+        *mutate(copy) += 1;
+      }
+    });
+  }
+}
+
+} // namespace
+
+int main()
+{
+  std::printf("%-28s %9s %10s %8s %8s %8s\n", "scenario", "ops", "allocs/op",
+              "p50 ns", "p99 ns", "p999 ns");
+  run("snapshot-then-mutate", snapshot_then_mutate);
+  run("fan-out reads", fan_out_reads);
+  run("upcast pipeline", upcast_pipeline);
+  run("small value churn", small_value_churn);
+}
@@ -2,6 +2,9 @@
 
 #include "copy_on_write.h"
 #include <catch.hpp>
+#include <array>
+#include <set>
+#include <system_error>
 
 struct BaseType
 {
@@ -671,3 +674,1310 @@ TEST_CASE("Gustafsson's dilemma: multiple (virtual) base classes", "[copy_on_wri
   }
 }
 
+
+TEST_CASE("biased_copy_on_write", "[biased_copy_on_write]")
+{
+  GIVEN("A biased_copy_on_write constructed from a copy_on_write")
+  {
+    auto c = make_copy_on_write<DerivedType>(7);
+    biased_copy_on_write<DerivedType> b(c);
+
+    THEN("The value is shared with the copy_on_write")
+    {
+      REQUIRE(&b.value() == &c.value());
+      REQUIRE(!b.unique());
+      REQUIRE(!c.unique());
+    }
+
+    WHEN("The biased handle is copied")
+    {
+      auto b2 = b;
+
+      THEN("Only one reference is taken to the shared control block")
+      {
+        c = copy_on_write<DerivedType>();
+        REQUIRE(!b.unique());
+        REQUIRE(!b2.unique());
+        REQUIRE(b.share().value().value() == 7);
+      }
+
+      THEN("Mutating a biased copy detaches it")
+      {
+        mutate(b2)->set_value(99);
+        REQUIRE(b2->value() == 99);
+        REQUIRE(b->value() == 7);
+        REQUIRE(c->value() == 7);
+        REQUIRE(b2.unique());
+      }
+
+      THEN("Mutating the copy_on_write detaches it")
+      {
+        mutate(c)->set_value(99);
+        REQUIRE(c->value() == 99);
+        REQUIRE(b->value() == 7);
+        REQUIRE(&b.value() == &b2.value());
+      }
+    }
+
+    WHEN("The copy_on_write is released")
+    {
+      c = copy_on_write<DerivedType>();
+
+      THEN("The biased handle is unique and mutates in place")
+      {
+        const auto p = &b.value();
+        REQUIRE(b.unique());
+        REQUIRE(mutate(b) == p);
+      }
+    }
+  }
+
+  GIVEN("A biased_copy_on_write copied on several threads")
+  {
+    biased_copy_on_write<DerivedType> b(make_copy_on_write<DerivedType>(7));
+    const auto p = &b.value();
+    std::atomic<int> sum{0};
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < 4; ++i)
+    {
+      workers.emplace_back([&] {
+        for (int j = 0; j < 1000; ++j)
+        {
+          auto copy = b;
+          auto moved = std::move(copy);
+          sum += moved->value();
+        }
+      });
+    }
+    for (auto& t : workers)
+    {
+      t.join();
+    }
+
+    THEN("The owner's handle is unique again and mutates in place")
+    {
+      REQUIRE(sum == 4 * 1000 * 7);
+      REQUIRE(b.unique());
+      REQUIRE(mutate(b) == p);
+      REQUIRE(DerivedType::object_count == 1);
+    }
+  }
+
+  GIVEN("A handle copied on its owning thread and released on another")
+  {
+    biased_copy_on_write<DerivedType> b(make_copy_on_write<DerivedType>(7));
+    auto copy = b;
+    b = biased_copy_on_write<DerivedType>();
+    std::thread([moved = std::move(copy)] {}).join();
+
+    THEN("The value is released once the owner next uses a biased handle")
+    {
+      REQUIRE(DerivedType::object_count == 1);
+      biased_copy_on_write<DerivedType> other(
+          make_copy_on_write<DerivedType>(1));
+      auto other_copy = other;
+      REQUIRE(DerivedType::object_count == 1);
+    }
+  }
+
+  GIVEN("Handles that outlive the thread that created them")
+  {
+    biased_copy_on_write<DerivedType> copy;
+    std::thread([&copy] {
+      biased_copy_on_write<DerivedType> b(make_copy_on_write<DerivedType>(7));
+      copy = b;
+    }).join();
+
+    THEN("The last handle is unique and releases the value on any thread")
+    {
+      REQUIRE(copy.unique());
+      REQUIRE(copy->value() == 7);
+      copy = biased_copy_on_write<DerivedType>();
+      REQUIRE(DerivedType::object_count == 0);
+    }
+  }
+
+  GIVEN("A default-constructed biased_copy_on_write")
+  {
+    biased_copy_on_write<DerivedType> b;
+
+    THEN("It is empty")
+    {
+      REQUIRE(!b);
+      REQUIRE(mutate(b) == nullptr);
+      REQUIRE(!b.share());
+    }
+  }
+}
+
+TEST_CASE("epoch_copy_on_write", "[epoch_copy_on_write]")
+{
+  auto& domain = epoch_domain::instance();
+  domain.reclaim();
+
+  GIVEN("An epoch_copy_on_write holding a value")
+  {
+    epoch_copy_on_write<DerivedType> cell(make_copy_on_write<DerivedType>(7));
+    REQUIRE(DerivedType::object_count == 1);
+
+    THEN("Readers borrow the value without taking a reference")
+    {
+      auto s = cell.read();
+      REQUIRE(s->value() == 7);
+      auto c = cell.load();
+      REQUIRE(c.use_count() == 2);
+      REQUIRE(&*c == &*s);
+    }
+
+    WHEN("The value is updated while a reader is active")
+    {
+      {
+        auto s = cell.read();
+        cell.update([](DerivedType& d) { d.set_value(99); });
+
+        THEN("The reader still sees the old value")
+        {
+          REQUIRE(s->value() == 7);
+          REQUIRE(DerivedType::object_count == 2);
+          REQUIRE(cell.read()->value() == 99);
+        }
+      }
+
+      THEN("The old value is released once the reader has left")
+      {
+        domain.reclaim();
+        REQUIRE(DerivedType::object_count == 1);
+        REQUIRE(domain.retired_count() == 0);
+      }
+    }
+
+    WHEN("A new value is stored without readers")
+    {
+      cell.store(make_copy_on_write<DerivedType>(42));
+
+      THEN("The old value is released immediately")
+      {
+        REQUIRE(DerivedType::object_count == 1);
+        REQUIRE(cell.read()->value() == 42);
+      }
+    }
+  }
+
+  GIVEN("An epoch_copy_on_write read and updated from several threads")
+  {
+    epoch_copy_on_write<DerivedType> cell(make_copy_on_write<DerivedType>(0));
+    std::atomic<bool> done{false};
+    std::atomic<bool> ordered{true};
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 4; ++i)
+    {
+      readers.emplace_back([&] {
+        int last = 0;
+        while (!done)
+        {
+          auto s = cell.read();
+          if (s->value() < last)
+          {
+            ordered = false;
+          }
+          last = s->value();
+        }
+      });
+    }
+
+    for (int i = 1; i <= 1000; ++i)
+    {
+      cell.update([i](DerivedType& d) { d.set_value(i); });
+    }
+    done = true;
+    for (auto& t : readers)
+    {
+      t.join();
+    }
+    domain.reclaim();
+
+    THEN("Readers observe values in order and retired values are released")
+    {
+      REQUIRE(ordered);
+      REQUIRE(cell.read()->value() == 1000);
+      REQUIRE(DerivedType::object_count == 1);
+    }
+  }
+
+  GIVEN("More concurrent readers than a fixed table of slots would hold")
+  {
+    epoch_copy_on_write<DerivedType> cell(make_copy_on_write<DerivedType>(7));
+    const int reader_count = 200;
+    std::atomic<int> reading{0};
+    std::atomic<int> sum{0};
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < reader_count; ++i)
+    {
+      readers.emplace_back([&] {
+        auto s = cell.read();
+        ++reading;
+        while (reading < reader_count)
+        {
+          std::this_thread::yield();
+        }
+        sum += s->value();
+      });
+    }
+    for (auto& t : readers)
+    {
+      t.join();
+    }
+
+    THEN("Every reader gets a slot")
+    {
+      REQUIRE(sum == 7 * reader_count);
+      REQUIRE(cell.read()->value() == 7);
+    }
+  }
+}
+
+TEST_CASE("make_cache_aligned_copy_on_write",
+          "[copy_on_write.make_cache_aligned_copy_on_write]")
+{
+  GIVEN("A copy_on_write<BaseType> constructed from "
+        "make_cache_aligned_copy_on_write<DerivedType>")
+  {
+    int v = 7;
+    copy_on_write<BaseType> cptr =
+        make_cache_aligned_copy_on_write<DerivedType>(v);
+
+    THEN("Operator-> calls the pointee method")
+    {
+      REQUIRE(cptr->value() == v);
+      REQUIRE(DerivedType::object_count == 1);
+    }
+
+    WHEN("A copy is mutated")
+    {
+      auto cptr2 = cptr;
+      mutate(cptr2)->set_value(99);
+
+      THEN("The copy is distinct")
+      {
+        REQUIRE(cptr->value() == v);
+        REQUIRE(cptr2->value() == 99);
+        REQUIRE(DerivedType::object_count == 2);
+      }
+    }
+  }
+}
+
+TEST_CASE("for_each_value", "[copy_on_write.algorithms]")
+{
+  GIVEN("A vector of copy_on_write including an empty handle")
+  {
+    std::vector<copy_on_write<BaseType>> v;
+    for (int i = 1; i <= 20; ++i)
+    {
+      v.push_back(make_copy_on_write<DerivedType>(i));
+    }
+    v.emplace_back();
+
+    THEN("Each non-empty value is visited in order")
+    {
+      std::vector<int> seen;
+      for_each_value(v, [&](const BaseType& b) { seen.push_back(b.value()); });
+      REQUIRE(seen.size() == 20);
+      REQUIRE(seen.front() == 1);
+      REQUIRE(seen.back() == 20);
+    }
+
+    THEN("Any prefetch distance visits every value")
+    {
+      int sum = 0;
+      for_each_value(v.begin(), v.end(),
+                     [&](const BaseType& b) { sum += b.value(); }, 0);
+      REQUIRE(sum == 210);
+    }
+  }
+}
+
+TEST_CASE("transform_mutate", "[copy_on_write.algorithms]")
+{
+  GIVEN("A vector of copy_on_write some of which are shared")
+  {
+    std::vector<copy_on_write<DerivedType>> v;
+    for (int i = 1; i <= 20; ++i)
+    {
+      v.push_back(make_copy_on_write<DerivedType>(i));
+    }
+    auto shared = v[3];
+    REQUIRE(DerivedType::object_count == 20);
+
+    WHEN("Every value is mutated")
+    {
+      transform_mutate(v, [](DerivedType& d) { d.set_value(d.value() * 2); },
+                       3);
+
+      THEN("Values are updated and shared values are detached")
+      {
+        REQUIRE(v[0]->value() == 2);
+        REQUIRE(v[3]->value() == 8);
+        REQUIRE(v[19]->value() == 40);
+        REQUIRE(shared->value() == 4);
+        REQUIRE(DerivedType::object_count == 21);
+      }
+    }
+  }
+}
+
+TEST_CASE("cow_slab", "[cow_slab]")
+{
+  GIVEN("Values made from a cow_slab")
+  {
+    cow_slab<DerivedType> slab(4);
+    std::vector<copy_on_write<DerivedType>> v;
+    for (int i = 0; i < 10; ++i)
+    {
+      v.push_back(slab.make(i));
+    }
+
+    THEN("Values are stored contiguously in pages")
+    {
+      REQUIRE(slab.page_count() == 3);
+      REQUIRE(slab.slots_in_use() == 10);
+      const auto stride = reinterpret_cast<const char*>(&*v[1]) -
+                          reinterpret_cast<const char*>(&*v[0]);
+      REQUIRE(stride > 0);
+      REQUIRE(reinterpret_cast<const char*>(&*v[3]) -
+                  reinterpret_cast<const char*>(&*v[2]) ==
+              stride);
+      REQUIRE(v[9]->value() == 9);
+      REQUIRE(sizeof(slab_shared_control_block<DerivedType>) ==
+              sizeof(shared_control_block<DerivedType>) + sizeof(DerivedType));
+    }
+
+    WHEN("A shared value is mutated")
+    {
+      auto c = v[0];
+      mutate(c)->set_value(99);
+
+      THEN("The clone is allocated from the slab")
+      {
+        REQUIRE(slab.slots_in_use() == 11);
+        REQUIRE(c->value() == 99);
+        REQUIRE(v[0]->value() == 0);
+      }
+    }
+
+    WHEN("Values are released")
+    {
+      v.resize(5);
+
+      THEN("Their slots are recycled")
+      {
+        REQUIRE(slab.slots_in_use() == 5);
+        v.push_back(slab.make(42));
+        REQUIRE(slab.page_count() == 3);
+        REQUIRE(DerivedType::object_count == 6);
+      }
+    }
+
+    THEN("Handles interoperate with copy_on_write<BaseType>")
+    {
+      copy_on_write<BaseType> b = v[2];
+      REQUIRE(b->value() == 2);
+    }
+  }
+
+  GIVEN("A value that outlives the cow_slab that made it")
+  {
+    copy_on_write<DerivedType> c;
+    {
+      cow_slab<DerivedType> slab;
+      c = slab.make(7);
+    }
+
+    THEN("The value remains usable and can be cloned")
+    {
+      auto c2 = c;
+      mutate(c2)->set_value(99);
+      REQUIRE(c->value() == 7);
+      REQUIRE(c2->value() == 99);
+    }
+  }
+}
+
+struct LargeTrivialType
+{
+  int values[1 << 18];
+};
+
+#if defined(__linux__)
+
+TEST_CASE("make_page_mapped_copy_on_write",
+          "[copy_on_write.make_page_mapped_copy_on_write]")
+{
+  GIVEN("A page-mapped copy_on_write that has been written in place")
+  {
+    auto c = make_page_mapped_copy_on_write<LargeTrivialType>();
+    const auto p = &c.value();
+    mutate(c)->values[0] = 1;
+
+    REQUIRE(mutate(c) == p);
+    REQUIRE(c->values[0] == 1);
+    REQUIRE(c->values[1000] == 0);
+
+    WHEN("A copy is mutated")
+    {
+      auto d = c;
+      mutate(d)->values[1000] = 2;
+
+      THEN("The copy holds the original value and its own change")
+      {
+        REQUIRE(&d.value() != p);
+        REQUIRE(d->values[0] == 1);
+        REQUIRE(d->values[1000] == 2);
+        REQUIRE(c->values[1000] == 0);
+      }
+
+      THEN("Later in-place writes to the original are not seen by the copy")
+      {
+        mutate(c)->values[200000] = 3;
+        REQUIRE(c->values[200000] == 3);
+        REQUIRE(d->values[200000] == 0);
+      }
+
+      THEN("A copy of the copy holds both changes")
+      {
+        auto e = d;
+        mutate(e)->values[5] = 4;
+        REQUIRE(e->values[0] == 1);
+        REQUIRE(e->values[1000] == 2);
+        REQUIRE(e->values[5] == 4);
+        REQUIRE(d->values[5] == 0);
+      }
+    }
+  }
+}
+
+#endif
+
+#if defined(__linux__)
+
+struct Point
+{
+  double x;
+  double y;
+};
+
+TEST_CASE("cow_image", "[cow_image]")
+{
+  GIVEN("An image saved from handles some of which share values")
+  {
+    const std::string path = "test_copy_on_write.img";
+    auto a = make_copy_on_write<Point>(Point{1.0, 2.0});
+    auto b = make_copy_on_write<Point>(Point{3.0, 4.0});
+    std::vector<copy_on_write<Point>> saved = {a, a, b, {}, a};
+    save_cow_image(path, saved.begin(), saved.end());
+
+    cow_image<Point> image(path);
+    std::remove(path.c_str());
+    auto loaded = image.handles();
+
+    THEN("Each distinct value is stored once and sharing is preserved")
+    {
+      REQUIRE(image.block_count() == 2);
+      REQUIRE(loaded.size() == 5);
+      REQUIRE(&loaded[0].value() == &loaded[1].value());
+      REQUIRE(&loaded[0].value() == &loaded[4].value());
+      REQUIRE(&loaded[0].value() != &loaded[2].value());
+      REQUIRE(!loaded[3]);
+      REQUIRE(loaded[0]->x == 1.0);
+      REQUIRE(loaded[2]->y == 4.0);
+    }
+
+    WHEN("A loaded handle is mutated")
+    {
+      auto c = image.handles()[2];
+      const auto mapped = &c.value();
+      mutate(c)->x = 99.0;
+
+      THEN("The value is cloned and the image is unchanged")
+      {
+        REQUIRE(&c.value() != mapped);
+        REQUIRE(c->x == 99.0);
+        REQUIRE(image.handles()[2]->x == 3.0);
+      }
+    }
+  }
+
+  GIVEN("A file that is not an image")
+  {
+    const std::string path = "test_copy_on_write.bad";
+    {
+      std::ofstream out(path);
+      out << "not an image";
+    }
+
+    THEN("Loading it throws")
+    {
+      REQUIRE_THROWS_AS(cow_image<Point>(path), std::runtime_error);
+      std::remove(path.c_str());
+    }
+  }
+}
+
+#endif
+
+TEST_CASE("copy_on_write identity", "[copy_on_write.observers]")
+{
+  auto c = make_copy_on_write<DerivedType>(7);
+  auto d = c;
+  copy_on_write<BaseType> b = c;
+  copy_on_write<BaseType> empty;
+
+  REQUIRE(c.identity() != nullptr);
+  REQUIRE(c.identity() == d.identity());
+  REQUIRE(b.identity() == c.identity());
+  REQUIRE(empty.identity() == nullptr);
+
+  mutate(d);
+  REQUIRE(c.identity() != d.identity());
+}
+
+struct ValueSize
+{
+  std::size_t operator()(const DerivedType& d) const
+  {
+    return std::size_t(d.value());
+  }
+};
+
+TEST_CASE("cow_history", "[cow_history]")
+{
+  GIVEN("A history with a budget of 100 bytes")
+  {
+    cow_history<DerivedType, ValueSize> history(100);
+    auto state = make_copy_on_write<DerivedType>(10);
+    history.commit(state);
+    history.commit(state);
+    mutate(state)->set_value(20);
+    history.commit(state);
+
+    THEN("Values shared by several snapshots are counted once")
+    {
+      REQUIRE(history.size() == 3);
+      REQUIRE(history.memory_usage() == 30);
+    }
+
+    THEN("Undo and redo move through the snapshots")
+    {
+      REQUIRE(history.current()->value() == 20);
+      REQUIRE(history.undo());
+      REQUIRE(history.current()->value() == 10);
+      REQUIRE(history.undo());
+      REQUIRE(!history.undo());
+      REQUIRE(history.redo());
+      REQUIRE(history.redo());
+      REQUIRE(!history.redo());
+      REQUIRE(history.current()->value() == 20);
+    }
+
+    WHEN("A commit is made after undoing")
+    {
+      history.undo();
+      history.commit(make_copy_on_write<DerivedType>(5));
+
+      THEN("The redo snapshots are discarded")
+      {
+        REQUIRE(!history.can_redo());
+        REQUIRE(history.size() == 3);
+        REQUIRE(history.memory_usage() == 15);
+      }
+    }
+
+    WHEN("A commit takes the history over budget")
+    {
+      history.commit(make_copy_on_write<DerivedType>(80));
+
+      THEN("The oldest snapshots are evicted")
+      {
+        REQUIRE(history.size() == 2);
+        REQUIRE(history.memory_usage() == 100);
+        REQUIRE(history.undo());
+        REQUIRE(history.current()->value() == 20);
+        REQUIRE(!history.can_undo());
+      }
+    }
+  }
+}
+
+TEST_CASE("memory_usage", "[copy_on_write.memory_usage]")
+{
+  GIVEN("A set of handles some of which share values with handles outside it")
+  {
+    auto a = make_copy_on_write<DerivedType>(10);
+    auto b = make_copy_on_write<DerivedType>(20);
+    auto outside = make_copy_on_write<DerivedType>(30);
+    std::vector<copy_on_write<DerivedType>> handles = {a, a, b, outside, {}};
+    a = copy_on_write<DerivedType>();
+
+    THEN("use_count reports the number of handles sharing a value")
+    {
+      REQUIRE(handles[0].use_count() == 2);
+      REQUIRE(handles[2].use_count() == 2);
+      REQUIRE(handles[4].use_count() == 0);
+    }
+
+    THEN("Total, deduplicated and exclusive sizes are reported")
+    {
+      auto report = memory_usage(handles.begin(), handles.end(), ValueSize{});
+      REQUIRE(report.total == 70);
+      REQUIRE(report.deduplicated == 60);
+      REQUIRE(report.exclusive == 10);
+    }
+
+    THEN("The default size function uses sizeof")
+    {
+      auto report = memory_usage(handles);
+      REQUIRE(report.total == 4 * sizeof(DerivedType));
+      REQUIRE(report.deduplicated == 3 * sizeof(DerivedType));
+      REQUIRE(report.exclusive == sizeof(DerivedType));
+    }
+  }
+
+  GIVEN("Upcast handles to a value")
+  {
+    auto d = make_copy_on_write<DerivedType>(10);
+    std::vector<copy_on_write<BaseType>> handles = {d};
+    d = copy_on_write<DerivedType>();
+
+    THEN("The value is conservatively treated as shared")
+    {
+      auto report = memory_usage(handles.begin(), handles.end(),
+                                 [](const BaseType& b) {
+                                   return std::size_t(b.value());
+                                 });
+      REQUIRE(report.deduplicated == 10);
+      REQUIRE(report.exclusive == 0);
+    }
+  }
+}
+
+TEST_CASE("weak_copy_on_write", "[weak_copy_on_write]")
+{
+  GIVEN("A weak_copy_on_write observing a value")
+  {
+    auto c = make_copy_on_write<DerivedType>(7);
+    weak_copy_on_write<DerivedType> w = c;
+
+    THEN("The value is not made to look shared")
+    {
+      const auto p = &c.value();
+      REQUIRE(c.unique());
+      REQUIRE(mutate(c) == p);
+      REQUIRE(!w.expired());
+    }
+
+    THEN("lock returns a handle sharing the value")
+    {
+      auto locked = w.lock();
+      REQUIRE(&locked.value() == &c.value());
+      REQUIRE(!c.unique());
+    }
+
+    WHEN("The value is mutated in place")
+    {
+      mutate(c)->set_value(8);
+
+      THEN("lock returns an empty handle")
+      {
+        REQUIRE(!w.expired());
+        REQUIRE(!w.lock());
+        REQUIRE(c.unique());
+      }
+    }
+
+    WHEN("A shared value is mutated")
+    {
+      auto d = c;
+      mutate(d)->set_value(8);
+
+      THEN("lock still returns the observed value")
+      {
+        auto locked = w.lock();
+        REQUIRE(locked);
+        REQUIRE(locked->value() == 7);
+        REQUIRE(&locked.value() == &c.value());
+      }
+    }
+
+    WHEN("The last owning handle is released")
+    {
+      c = copy_on_write<DerivedType>();
+
+      THEN("The value is destroyed and lock returns an empty handle")
+      {
+        REQUIRE(DerivedType::object_count == 0);
+        REQUIRE(w.expired());
+        REQUIRE(!w.lock());
+      }
+    }
+  }
+
+  GIVEN("A default-constructed weak_copy_on_write")
+  {
+    weak_copy_on_write<DerivedType> w;
+
+    THEN("It is expired")
+    {
+      REQUIRE(w.expired());
+      REQUIRE(!w.lock());
+    }
+  }
+}
+
+struct DestructionThread
+{
+  std::thread::id* destroyed_on;
+
+  ~DestructionThread()
+  {
+    *destroyed_on = std::this_thread::get_id();
+  }
+};
+
+TEST_CASE("deferred_delete", "[copy_on_write.deferred_delete]")
+{
+  GIVEN("A copy_on_write constructed with a deferred_delete deleter")
+  {
+    deferred_reclaimer reclaimer;
+    std::thread::id destroyed_on;
+    {
+      copy_on_write<DestructionThread> c(
+          new DestructionThread{&destroyed_on},
+          default_copy<DestructionThread>{},
+          deferred_delete<DestructionThread>(reclaimer));
+    }
+    reclaimer.drain();
+
+    THEN("The value is destroyed on the reclaimer thread")
+    {
+      REQUIRE(destroyed_on != std::thread::id());
+      REQUIRE(destroyed_on != std::this_thread::get_id());
+    }
+  }
+
+  GIVEN("A value from make_deferred_copy_on_write and a detached clone")
+  {
+    {
+      auto c = make_deferred_copy_on_write<DerivedType>(7);
+      auto d = c;
+      mutate(d)->set_value(99);
+      REQUIRE(DerivedType::object_count == 2);
+    }
+    deferred_reclaimer::instance().drain();
+
+    THEN("Both are destroyed by the reclaimer")
+    {
+      REQUIRE(DerivedType::object_count == 0);
+    }
+  }
+}
+
+TEST_CASE("parallel_copy", "[copy_on_write.parallel_copy]")
+{
+  GIVEN("A large vector copied with parallel_copy")
+  {
+    using vector_type = std::vector<double, default_init_allocator<double>>;
+    auto v = new vector_type(3 << 20);
+    for (std::size_t i = 0; i < v->size(); ++i)
+    {
+      (*v)[i] = double(i);
+    }
+    copy_on_write<vector_type> c(v, parallel_copy<vector_type>(4));
+    auto d = c;
+    mutate(d)->back() = -1.0;
+
+    THEN("The copy is equal apart from the change")
+    {
+      REQUIRE(&c.value() != &d.value());
+      REQUIRE(d->size() == c->size());
+      REQUIRE(std::equal(c->begin(), c->end() - 1, d->begin()));
+      REQUIRE(c->back() == double(c->size() - 1));
+      REQUIRE(d->back() == -1.0);
+    }
+  }
+
+  GIVEN("A large vector with the default allocator copied with parallel_copy")
+  {
+    using vector_type = std::vector<double>;
+    auto v = new vector_type(3 << 20);
+    for (std::size_t i = 0; i < v->size(); ++i)
+    {
+      (*v)[i] = double(i);
+    }
+    copy_on_write<vector_type> c(v, parallel_copy<vector_type>(4));
+    auto d = c;
+    mutate(d)->front() = -1.0;
+
+    THEN("The copy is equal apart from the change")
+    {
+      REQUIRE(&c.value() != &d.value());
+      REQUIRE(d->size() == c->size());
+      REQUIRE(std::equal(c->begin() + 1, c->end(), d->begin() + 1));
+      REQUIRE(c->front() == 0.0);
+      REQUIRE(d->front() == -1.0);
+    }
+  }
+
+  GIVEN("A large trivially copyable value copied with parallel_copy")
+  {
+    // Large enough to be split between all three threads.
+    constexpr int size = 1 << 20;
+    using value_type = std::array<int, size>;
+    copy_on_write<value_type> c(new value_type,
+                                parallel_copy<value_type>(3));
+    for (int i = 0; i < size; ++i)
+    {
+      (*mutate(c))[i] = i;
+    }
+    auto d = c;
+    (*mutate(d))[0] = -1;
+
+    THEN("The copy is equal apart from the change")
+    {
+      REQUIRE((*d)[0] == -1);
+      REQUIRE(std::equal(c->begin() + 1, c->end(), d->begin() + 1));
+    }
+  }
+
+  GIVEN("A type that is not contiguous copied with parallel_copy")
+  {
+    copy_on_write<DerivedType> c(new DerivedType(7),
+                                 parallel_copy<DerivedType>());
+    auto d = c;
+    mutate(d)->set_value(99);
+
+    THEN("The copy constructor is used")
+    {
+      REQUIRE(c->value() == 7);
+      REQUIRE(d->value() == 99);
+      REQUIRE(DerivedType::object_count == 2);
+    }
+  }
+}
+
+TEST_CASE("copy_on_write version", "[copy_on_write.version]")
+{
+  GIVEN("A copy_on_write and a copy of it")
+  {
+    auto c = make_copy_on_write<DerivedType>(7);
+    auto d = c;
+    copy_on_write<BaseType> b = c;
+    const auto v = c.version();
+
+    THEN("Copies share the version")
+    {
+      REQUIRE(v != 0);
+      REQUIRE(d.version() == v);
+      REQUIRE(b.version() == v);
+      REQUIRE(copy_on_write<DerivedType>().version() == 0);
+    }
+
+    THEN("Mutating a copy changes only its version")
+    {
+      mutate(d);
+      REQUIRE(d.version() > v);
+      REQUIRE(c.version() == v);
+    }
+
+    THEN("Mutating a unique value in place changes its version")
+    {
+      auto e = make_copy_on_write<DerivedType>(1);
+      const auto w = e.version();
+      mutate(e);
+      REQUIRE(e.version() > w);
+    }
+
+    THEN("Assigning another value changes the identity")
+    {
+      d = make_copy_on_write<DerivedType>(7);
+      REQUIRE(d.identity() != c.identity());
+    }
+
+    THEN("Copy assignment changes the version")
+    {
+      auto e = make_copy_on_write<DerivedType>(1);
+      const auto w = e.version();
+      e = c;
+      REQUIRE(e.version() != w);
+      REQUIRE(e.version() != v);
+    }
+
+    THEN("Many mutations in place never repeat a version")
+    {
+      auto e = make_copy_on_write<DerivedType>(1);
+      auto f = make_copy_on_write<DerivedType>(2);
+      std::set<std::uint64_t> seen{e.version(), f.version()};
+      for (int i = 0; i < 3000; ++i)
+      {
+        mutate(e);
+        mutate(f);
+        REQUIRE(seen.insert(e.version()).second);
+        REQUIRE(seen.insert(f.version()).second);
+      }
+    }
+
+    THEN("Handles are no larger than a pointer and a shared_ptr")
+    {
+      REQUIRE(sizeof(c) ==
+              sizeof(DerivedType*) + sizeof(std::shared_ptr<DerivedType>));
+    }
+  }
+}
+
+TEST_CASE("copy_on_write version after reuse of memory",
+          "[copy_on_write.version]")
+{
+  using V = std::array<int, 32>;
+
+  GIVEN("A handle whose version has been recorded")
+  {
+    auto a = make_copy_on_write<V>(V{{1}});
+    const auto v = a.version();
+
+    WHEN("It is reset and assigned a new value of the same size")
+    {
+      a = {};
+      a = make_copy_on_write<V>(V{{2}});
+
+      THEN("The version reports a change")
+      {
+        REQUIRE((*a)[0] == 2);
+        REQUIRE(a.version() != v);
+      }
+    }
+  }
+}
+
+TEST_CASE("diff and apply_patch", "[copy_on_write.diff]")
+{
+  using Inner = std::map<int, copy_on_write<std::string>>;
+  using Outer = std::map<std::string, copy_on_write<Inner>>;
+
+  GIVEN("Two replicas synchronised by patches")
+  {
+    Inner inner;
+    inner.emplace(1, make_copy_on_write<std::string>("one"));
+    inner.emplace(2, make_copy_on_write<std::string>("two"));
+    Outer outer;
+    outer.emplace("a", make_copy_on_write<Inner>(inner));
+    outer.emplace("b", make_copy_on_write<Inner>(inner));
+
+    auto sender = make_copy_on_write<Outer>(outer);
+    copy_on_write<Outer> receiver;
+    apply_patch(receiver, diff(copy_on_write<Outer>(), sender));
+    REQUIRE(receiver.identity() == sender.identity());
+
+    WHEN("The sender changes one nested value")
+    {
+      const auto before = sender;
+      auto& a = mutate(sender)->find("a")->second;
+      auto& one = mutate(a)->find(1)->second;
+      *mutate(one) = "uno";
+
+      auto patch = diff(before, sender);
+
+      THEN("The patch only describes the changed path")
+      {
+        REQUIRE(patch.changed);
+        REQUIRE(patch.inserted.empty());
+        REQUIRE(patch.erased.empty());
+        REQUIRE(patch.updated.size() == 1);
+        REQUIRE(patch.updated[0].first == "a");
+        REQUIRE(patch.updated[0].second.updated.size() == 1);
+        REQUIRE(patch.updated[0].second.updated[0].first == 1);
+      }
+
+      THEN("Applying it updates the receiver and shares the rest")
+      {
+        const auto b = receiver->at("b").identity();
+        const auto two = receiver->at("a")->at(2).identity();
+        apply_patch(receiver, patch);
+
+        REQUIRE(*receiver->at("a")->at(1) == "uno");
+        REQUIRE(*before->at("a")->at(1) == "one");
+        REQUIRE(receiver->at("b").identity() == b);
+        REQUIRE(receiver->at("a")->at(2).identity() == two);
+      }
+    }
+
+    WHEN("The sender inserts and erases entries")
+    {
+      const auto before = sender;
+      mutate(sender)->erase("b");
+      mutate(sender)->emplace("c", make_copy_on_write<Inner>());
+      apply_patch(receiver, diff(before, sender));
+
+      THEN("The receiver has the same entries")
+      {
+        REQUIRE(receiver->size() == 2);
+        REQUIRE(receiver->count("b") == 0);
+        REQUIRE(receiver->at("c").identity() == sender->at("c").identity());
+      }
+    }
+
+    WHEN("The receiver has diverged and lacks an entry the patch updates")
+    {
+      const auto before = sender;
+      auto& a = mutate(sender)->find("a")->second;
+      *mutate(mutate(a)->find(1)->second) = "uno";
+      auto patch = diff(before, sender);
+
+      mutate(mutate(receiver)->find("a")->second)->erase(1);
+      const auto diverged = receiver.identity();
+      const auto inner = receiver->at("a").identity();
+
+      THEN("Applying the patch reports the mismatch and changes nothing")
+      {
+        REQUIRE_THROWS_AS(apply_patch(receiver, patch), std::invalid_argument);
+        REQUIRE(receiver.identity() == diverged);
+        REQUIRE(receiver->at("a").identity() == inner);
+        REQUIRE(receiver->at("a")->count(1) == 0);
+      }
+    }
+
+    THEN("Identical replicas produce an empty patch")
+    {
+      REQUIRE(!diff(sender, receiver).changed);
+    }
+  }
+}
+
+TEST_CASE("async_mutate", "[copy_on_write.async_mutate]")
+{
+  GIVEN("A unique copy_on_write")
+  {
+    auto c = make_copy_on_write<DerivedType>(7);
+    const auto p = &c.value();
+
+    THEN("The future is ready immediately and no copy is made")
+    {
+      auto f = async_mutate(c);
+      REQUIRE(f.wait_for(std::chrono::seconds(0)) ==
+              std::future_status::ready);
+      REQUIRE(f.get() == p);
+    }
+  }
+
+  GIVEN("Two handles sharing a value")
+  {
+    size_t copy_count = 0;
+    auto copier = [&](const DerivedType& d) {
+      ++copy_count;
+      return new DerivedType(d);
+    };
+    copy_on_write<DerivedType> a(new DerivedType(7), copier);
+    auto b = a;
+    const auto p = &a.value();
+
+    WHEN("Both are mutated asynchronously")
+    {
+      auto fa = async_mutate(a);
+      auto fb = async_mutate(b);
+      auto pa = fa.get();
+      auto pb = fb.get();
+
+      THEN("The second request waits for the first and needs no copy")
+      {
+        REQUIRE(pa != p);
+        REQUIRE(pb == p);
+        REQUIRE(copy_count == 1);
+        REQUIRE(a.unique());
+        REQUIRE(b.unique());
+      }
+    }
+  }
+
+  GIVEN("Two handles sharing a value and an executor that fails")
+  {
+    auto a = make_copy_on_write<DerivedType>(7);
+    auto b = a;
+    auto failing = [](std::function<void()>) {
+      throw std::system_error(
+          std::make_error_code(std::errc::resource_unavailable_try_again));
+    };
+
+    WHEN("A request cannot be submitted")
+    {
+      auto fa = async_mutate(a, failing);
+
+      THEN("Its future reports the failure and later requests still run")
+      {
+        REQUIRE_THROWS_AS(fa.get(), std::system_error);
+        REQUIRE(&a.value() == &b.value());
+        auto fb = async_mutate(b);
+        REQUIRE(fb.wait_for(std::chrono::seconds(10)) ==
+                std::future_status::ready);
+        REQUIRE(fb.get() != &a.value());
+      }
+    }
+  }
+
+  GIVEN("Three handles sharing a value and an executor run by hand")
+  {
+    size_t copy_count = 0;
+    auto copier = [&](const DerivedType& d) {
+      ++copy_count;
+      return new DerivedType(d);
+    };
+    copy_on_write<DerivedType> a(new DerivedType(7), copier);
+    auto b = a;
+    auto c = a;
+    const auto p = &c.value();
+
+    std::vector<std::function<void()>> tasks;
+    auto executor = [&](std::function<void()> f) { tasks.push_back(f); };
+
+    WHEN("Two of them are mutated asynchronously")
+    {
+      auto fa = async_mutate(a, executor);
+      auto fb = async_mutate(b, executor);
+
+      THEN("Both clones start at once and can run in any order")
+      {
+        REQUIRE(tasks.size() == 2);
+        tasks[1]();
+        tasks[0]();
+        REQUIRE(fa.get() != p);
+        REQUIRE(fb.get() != p);
+        REQUIRE(copy_count == 2);
+        REQUIRE(c.unique());
+      }
+    }
+
+    WHEN("All of them are mutated asynchronously")
+    {
+      auto fa = async_mutate(a, executor);
+      auto fb = async_mutate(b, executor);
+      auto fc = async_mutate(c, executor);
+
+      THEN("The last request waits without a task and needs no copy")
+      {
+        REQUIRE(tasks.size() == 2);
+        tasks[1]();
+        REQUIRE(fc.wait_for(std::chrono::seconds(0)) ==
+                std::future_status::timeout);
+        tasks[0]();
+        REQUIRE(fc.get() == p);
+        REQUIRE(copy_count == 2);
+        REQUIRE(fa.get() != fb.get());
+      }
+    }
+  }
+}
+
+TEST_CASE("prepare_mutate", "[copy_on_write.prepare_mutate]")
+{
+  GIVEN("Two handles sharing a value and an executor run by hand")
+  {
+    size_t copy_count = 0;
+    auto copier = [&](const DerivedType& d) {
+      ++copy_count;
+      return new DerivedType(d);
+    };
+    copy_on_write<DerivedType> a(new DerivedType(7), copier);
+    auto b = a;
+    const auto p = &a.value();
+
+    std::vector<std::function<void()>> tasks;
+    auto executor = [&](std::function<void()> f) { tasks.push_back(f); };
+    prepare_mutate(a, executor);
+    REQUIRE(tasks.size() == 1);
+
+    WHEN("The clone is ready before the handle is mutated")
+    {
+      tasks[0]();
+      REQUIRE(copy_count == 1);
+      mutate(a)->set_value(99);
+
+      THEN("mutate installs the prepared clone")
+      {
+        REQUIRE(copy_count == 1);
+        REQUIRE(&a.value() != p);
+        REQUIRE(a->value() == 99);
+        REQUIRE(b->value() == 7);
+      }
+    }
+
+    WHEN("The handle is mutated before the clone is ready")
+    {
+      mutate(a)->set_value(99);
+      tasks[0]();
+
+      THEN("mutate clones the value itself")
+      {
+        REQUIRE(copy_count == 2);
+        REQUIRE(a->value() == 99);
+        REQUIRE(b->value() == 7);
+      }
+    }
+
+    WHEN("The value becomes unique before the clone is made")
+    {
+      b = copy_on_write<DerivedType>();
+      tasks[0]();
+
+      THEN("The clone is dropped and mutate works in place")
+      {
+        REQUIRE(DerivedType::object_count == 1);
+        REQUIRE(mutate(a) == p);
+      }
+    }
+
+    WHEN("The value is mutated in place after the clone is made")
+    {
+      tasks[0]();
+      b = copy_on_write<DerivedType>();
+      mutate(a)->set_value(99);
+      REQUIRE(DerivedType::object_count == 1);
+      b = copy_on_write<DerivedType>(a);
+      mutate(a)->set_value(100);
+
+      THEN("The stale clone is not used")
+      {
+        REQUIRE(copy_count == 2);
+        REQUIRE(a->value() == 100);
+        REQUIRE(b->value() == 99);
+      }
+    }
+
+    WHEN("The value is released without being mutated after the clone is made")
+    {
+      auto c = a;
+      tasks[0]();
+      REQUIRE(DerivedType::object_count == 2);
+      a = copy_on_write<DerivedType>();
+      b = copy_on_write<DerivedType>();
+      c = copy_on_write<DerivedType>();
+
+      THEN("The clone is freed with it")
+      {
+        REQUIRE(copy_count == 1);
+        REQUIRE(DerivedType::object_count == 0);
+      }
+    }
+  }
+
+  GIVEN("A unique copy_on_write")
+  {
+    auto c = make_copy_on_write<DerivedType>(7);
+    bool called = false;
+    prepare_mutate(c, [&](std::function<void()>) { called = true; });
+
+    THEN("No clone is prepared")
+    {
+      REQUIRE(!called);
+    }
+  }
+}